@@ -3,8 +3,12 @@ layout (location = 0) in vec3 a_Pos;
 layout (location = 1) in vec2 a_Normal;
 
 uniform mat4 u_Model;
-uniform mat4 u_View;
-uniform mat4 u_Projection;
+// per frame, shared by all shaders
+layout (std140) uniform Camera {
+    mat4 u_View;
+    mat4 u_Projection;
+    vec3 u_CameraPos;
+};
 
 void main()
 {
@@ -0,0 +1,62 @@
+#version 330 core
+layout (location = 0) in vec2 a_Pos;   // grid coordinates in segments
+layout (location = 1) in vec4 a_Node;  // corner x, corner z, size, lod
+
+// per frame, shared by all shaders
+layout (std140) uniform Camera {
+    mat4 u_View;
+    mat4 u_Projection;
+    vec3 u_CameraPos;
+};
+
+uniform sampler2DArray u_Heightmap;  // one layer per lod, stored toroidally
+uniform sampler2DArray u_Normalmap;
+
+uniform float   u_StackSize;  // texels along one side of a layer
+uniform float   u_Grid;       // segments along one side of a node
+uniform vec2    u_Morph[16];  // distances where the morph of a lod starts and ends
+
+out vec3 Color;
+out vec3 Normal;
+out vec3 FragPos;
+out vec2 TexCoord;
+
+flat out float Layer;
+
+float getHeight(vec2 uv)
+{
+    return 3000.0 * texture(u_Heightmap, vec3(uv, Layer)).r;
+}
+
+vec3 getNormal(vec2 uv)
+{
+    return normalize(texture(u_Normalmap, vec3(uv, Layer)).rgb);
+}
+
+// texel i of a layer is at world i * spacing, the texels wrap around the layer
+vec2 getUV(vec2 pos, float spacing)
+{
+    return (pos / spacing + 0.5) / u_StackSize;
+}
+
+void main()
+{
+    // the layer of the stack with the vertex spacing of the lod
+    Layer = a_Node.w;
+    float spacing = a_Node.z / u_Grid;
+    vec2 pos = a_Node.xy + a_Pos * spacing;
+
+    // moves the vertices between the vertices of the next coarser lod onto its grid, by the distance to the camera
+    vec2 range = u_Morph[int(a_Node.w)];
+    float distance = length(vec3(pos.x, getHeight(getUV(pos, spacing)), pos.y) - u_CameraPos);
+    float t = clamp((distance - range.x) / (range.y - range.x), 0.0, 1.0);
+    pos -= mod(a_Pos, 2.0) * spacing * t;
+
+    TexCoord = getUV(pos, spacing);
+    FragPos = vec3(pos.x, getHeight(TexCoord), pos.y);
+    Normal = getNormal(TexCoord);
+
+    Color = vec3(1.0, a_Node.w / 16.0, 0.0);
+
+    gl_Position = u_Projection * u_View * vec4(FragPos, 1.0);
+}
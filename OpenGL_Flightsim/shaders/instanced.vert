@@ -0,0 +1,32 @@
+#version 330 core
+layout (location = 0) in vec3 a_Pos;
+layout (location = 1) in vec3 a_Normal;
+layout (location = 2) in vec2 a_TexCoord;
+layout (location = 3) in mat4 a_Model;  // per instance, locations 3 to 6
+layout (location = 7) in vec4 a_Color;  // per instance
+
+out vec3 FragPos;
+out vec3 Normal;
+out vec2 TexCoords;
+out vec4 FragPosLightSpace;
+out vec3 Tint;
+
+// per frame, shared by all shaders
+layout (std140) uniform Camera {
+    mat4 u_View;
+    mat4 u_Projection;
+    vec3 u_CameraPos;
+};
+uniform mat4 u_LightSpaceMatrix;
+
+void main()
+{
+    FragPos = vec3(a_Model * vec4(a_Pos, 1.0));
+    gl_Position = u_Projection * u_View * vec4(FragPos, 1.0);
+
+    // the instances are only moved and rotated, so the model matrix also transforms the normals
+    TexCoords = a_TexCoord;
+    Normal = mat3(a_Model) * a_Normal;
+    FragPosLightSpace = u_LightSpaceMatrix * vec4(FragPos, 1.0);
+    Tint = a_Color.rgb;
+}
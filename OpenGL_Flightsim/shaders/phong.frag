@@ -5,8 +5,14 @@ in vec3 Normal;
 in vec3 FragPos;  
 in vec2 TexCoords;
 in vec4 FragPosLightSpace;
+in vec3 Tint;  // per instance color of instanced.vert
   
-uniform vec3 u_CameraPosition; 
+// per frame, shared by all shaders
+layout (std140) uniform Camera {
+    mat4 u_View;
+    mat4 u_Projection;
+    vec3 u_CameraPos;
+};
 
 // phong lighting parameters
 uniform float ka;
@@ -30,12 +36,14 @@ struct Light {
 };
 
 #define MAX_LIGHTS 4
-uniform int u_NumLights;
-uniform Light u_Lights[MAX_LIGHTS];
+layout (std140) uniform Lights {
+    int u_NumLights;
+    Light u_Lights[MAX_LIGHTS];
+};
 
 vec3 getColor()
 {
-	return u_UseTexture ? vec3(texture(u_Texture1, TexCoords)) : u_SolidObjectColor;
+	return Tint * (u_UseTexture ? vec3(texture(u_Texture1, TexCoords)) : u_SolidObjectColor);
 	//return vec3(1, 0, 0);
 
 }
@@ -69,7 +77,7 @@ vec3 calculateDirLight(Light light)
     vec3 diffuse = kd * max(dot(norm, lightDir), 0.0) * light.color;
     
     // specular
-    vec3 u_ViewDir = normalize(u_CameraPosition - FragPos);
+    vec3 u_ViewDir = normalize(u_CameraPos - FragPos);
     vec3 reflectDir = reflect(-lightDir, norm);  
     vec3 specular = ks * pow(max(dot(u_ViewDir, reflectDir), 0.0), alpha) * light.color;
 
@@ -99,7 +107,7 @@ vec3 calculatePointLight(Light light)
     vec3 diffuse = kd * max(dot(norm, lightDir), 0.0) * light.color;
     
     // specular
-    vec3 u_ViewDir = normalize(u_CameraPosition - FragPos);
+    vec3 u_ViewDir = normalize(u_CameraPos - FragPos);
     vec3 reflectDir = reflect(-lightDir, norm);  
     vec3 specular = ks * pow(max(dot(u_ViewDir, reflectDir), 0.0), alpha) * light.color;
 
@@ -114,11 +122,11 @@ vec3 calculatePointLight(Light light)
 
 #if 0
 	// https://ijdykeman.github.io/graphics/simple_fog_shader
-	vec3 cameraDir = u_CameraPosition - FragPos;
+	vec3 cameraDir = u_CameraPos - FragPos;
 	vec3 cameraDir = -u_ViewDir;
-	float b = length(light.position - u_CameraPosition);
+	float b = length(light.position - u_CameraPos);
 
-	float h = length(cross(light.position - u_CameraPosition, cameraDir)) / length(cameraDir);
+	float h = length(cross(light.position - u_CameraPos, cameraDir)) / length(cameraDir);
 	float dropoff = 1.0;
 	float fog = (atan(b / h) / (h * dropoff));
 
@@ -160,12 +168,12 @@ void main()
 #if 0	
 	// fog
 
-	float tmp = dot(vec3(0,1,0), u_CameraPosition - FragPos);
+	float tmp = dot(vec3(0,1,0), u_CameraPos - FragPos);
 
 	vec4 fogColor = vec4(u_BackgroundColor, 1.0);
 	float fogMin = 4.1;
 	float fogMax = 100.0;
-	float dist = length(u_CameraPosition - FragPos);
+	float dist = length(u_CameraPos - FragPos);
 	float fogFactor = (fogMax - dist) / (fogMax - fogMin);
 
 	fogFactor = clamp(fogFactor, 0.0, 1.0);
@@ -7,10 +7,15 @@ out vec3 FragPos;
 out vec3 Normal;
 out vec2 TexCoords;
 out vec4 FragPosLightSpace;
+out vec3 Tint;
 
 uniform mat4 u_Model;
-uniform mat4 u_View;
-uniform mat4 u_Projection;
+// per frame, shared by all shaders
+layout (std140) uniform Camera {
+    mat4 u_View;
+    mat4 u_Projection;
+    vec3 u_CameraPos;
+};
 uniform mat4 u_LightSpaceMatrix;
 
 void main()
@@ -28,4 +33,5 @@ void main()
     TexCoords = a_TexCoord;
     Normal = mat3(transpose(inverse(u_Model))) * a_Normal;  
     FragPosLightSpace = u_LightSpaceMatrix * vec4(FragPos, 1.0);
+    Tint = vec3(1.0);
 }
\ No newline at end of file
@@ -4,16 +4,22 @@ out vec4 FragColor;
 
 uniform float u_Level;
 uniform vec3 u_Background;
-uniform sampler2D u_Heightmap;
-uniform sampler2D u_Normalmap;
-uniform sampler2D u_Texture;
-uniform vec3 u_CameraPos;
+uniform sampler2DArray u_Heightmap;
+uniform sampler2DArray u_Normalmap;
+uniform sampler2DArray u_Texture;
+
+// per frame, shared by all shaders
+layout (std140) uniform Camera {
+    mat4 u_View;
+    mat4 u_Projection;
+    vec3 u_CameraPos;
+};
 
 in vec3 Color;
 in vec3 Normal;
 in vec3 FragPos;
 in vec2 TexCoord;
-flat in float Factor;
+flat in float Layer;
 
 vec3 calculateDirLight(vec3 direction, vec3 normal, vec3 color)
 {
@@ -44,6 +50,6 @@ void main()
   float fogFactor = (fogMaxdist - dist) / (fogMaxdist - fogMindist);
   fogFactor = clamp(fogFactor, 0.0, 1.0);
 
-  vec4 terrainColor = vec4(calculateDirLight(lightDir, Normal, texture(u_Texture, TexCoord).rgb), 1.0);
+  vec4 terrainColor = vec4(calculateDirLight(lightDir, Normal, texture(u_Texture, vec3(TexCoord, Layer)).rgb), 1.0);
   FragColor = mix(fogColor, terrainColor, fogFactor);
 }
@@ -1,42 +1,37 @@
 #version 330 core
-layout (location = 0) in vec3 a_Pos;
-
-uniform mat4 u_View;
-uniform mat4 u_Model;
-uniform mat4 u_Projection;
-
-uniform sampler2D u_Heightmap;
-uniform sampler2D u_Normalmap;
-
-uniform vec3    u_CameraPos;
-uniform float   u_Scale;
-uniform float   u_SegmentSize;
-uniform float   u_Level;
-uniform float   u_TerrainSize;
+layout (location = 0) in vec2 a_Pos;       // grid coordinates in segments
+layout (location = 1) in vec4 a_Instance;  // offset x, offset z, scale, rotation around the up axis
+layout (location = 2) in float a_Level;
+
+// per frame, shared by all shaders
+layout (std140) uniform Camera {
+    mat4 u_View;
+    mat4 u_Projection;
+    vec3 u_CameraPos;
+};
+
+uniform sampler2DArray u_Heightmap;  // one layer per level, stored toroidally
+uniform sampler2DArray u_Normalmap;
+
+uniform float   u_StackSize;    // texels along one side of a layer
+uniform float   u_SegmentSize;  // of level 0
+uniform float   u_Segments;     // per tile
+uniform float   u_MinScale;     // scale of the finest level
+uniform float   u_MinMorph;     // morph of the finest level, it fades in with the height above ground
 
 out vec3 Color;
 out vec3 Normal;
 out vec3 FragPos;
 out vec2 TexCoord;
 
-flat out float Factor;
-
-float scale(float input_val, float in_min, float in_max, float out_min, float out_max)
-{
-    return (input_val - in_min) * (out_max - out_min) / (in_max - in_min) + out_min;
-}
+flat out float Layer;
 
 float getHeight(vec2 uv)
 {
-    if (uv.x < 0 || uv.x > 1 || uv.y < 0 || uv.x > 1)
-    {
-        return 0.0;
-    }
-
 #if 1
-    float height = texture(u_Heightmap, uv).r;
+    float height = texture(u_Heightmap, vec3(uv, Layer)).r;
 #else
-    vec3 val = texture(u_Heightmap, uv).rgb * 255.0;
+    vec3 val = texture(u_Heightmap, vec3(uv, Layer)).rgb * 255.0;
     float height = (val.r * 256.0 + val.g + val.b / 256.0) - 32768.0;
 #endif
 
@@ -48,30 +43,52 @@ float getHeight(vec2 uv)
 
 vec3 getNormal(vec2 uv)
 {
-    return normalize(texture(u_Normalmap, uv).rgb);
+    return normalize(texture(u_Normalmap, vec3(uv, Layer)).rgb);
+}
+
+// texel i of a layer is at world i * spacing, the texels wrap around the layer
+vec2 getUV(vec2 pos, float scale)
+{
+    return (pos / (u_SegmentSize * scale) + 0.5) / u_StackSize;
 }
 
-vec2 getUV(vec2 pos)
+// moves the vertices in the outer part of a level onto the grid of the next coarser level, so at its outer edge a
+// level matches the coarser one exactly
+vec2 morph(vec2 pos, float scale)
 {
-    vec2 coord = pos / Factor;
-    coord.x = scale(coord.x, -1.0, 1.0, 0.0, 1.0);
-    coord.y = scale(coord.y, -1.0, 1.0, 0.0, 1.0);
-    return coord;
+    float spacing = u_SegmentSize * scale;
+    float tile = u_Segments * spacing;
+
+    // the ring reaches 2 tiles and up to 2 more segments from the camera, it snaps to the grid of the coarser level.
+    // the morph ends before the nearest outer edge and starts after the outer edge of the finer level, 1 tile away
+    float end = 2.0 * tile - 2.0 * spacing;
+    float start = end - 0.5 * tile;
+    vec2 d = abs(pos - u_CameraPos.xz);
+    float t = clamp((max(d.x, d.y) - start) / (end - start), 0.0, 1.0);
+    if (scale == u_MinScale) t = max(t, u_MinMorph);
+
+    // 1 for the vertices between the vertices of the coarser grid
+    vec2 odd = mod(floor(pos / spacing + 0.5), 2.0);
+    return pos - odd * spacing * t;
 }
 
 void main()
 {
-    // size of the area covered by the heightmap
-    Factor = u_TerrainSize / 2.0;
+    // the layer of the stack with the vertex spacing of the level
+    Layer = log2(a_Instance.z) - 1.0;
 
-    FragPos = vec3(u_Model * vec4(a_Pos, 1.0));
-    TexCoord = getUV(FragPos.xz);
+    // same as translate * rotate * scale of the block
+    vec3 scaled = vec3(a_Pos.x, 0.0, a_Pos.y) * u_SegmentSize * a_Instance.z;
+    float c = cos(a_Instance.w), s = sin(a_Instance.w);
+    FragPos = vec3(c * scaled.x + s * scaled.z + a_Instance.x, scaled.y, -s * scaled.x + c * scaled.z + a_Instance.y);
+    FragPos.xz = morph(FragPos.xz, a_Instance.z);
+    TexCoord = getUV(FragPos.xz, a_Instance.z);
 
     FragPos.y = getHeight(TexCoord);
 
     Normal = getNormal(TexCoord);
 
-	  Color = vec3(1.0, u_Level, 0.0);
+	  Color = vec3(1.0, a_Level, 0.0);
 
     gl_Position = u_Projection * u_View * vec4(FragPos, 1.0);
 }
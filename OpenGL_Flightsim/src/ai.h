@@ -1,19 +1,106 @@
 #pragma once
 
+#include <algorithm>
+#include <chrono>
 #include <glm/glm.hpp>
 #include <glm/gtx/vector_angle.hpp>
+#include <vector>
 
 #include "flightmodel.h"
 
+// time for a pursuer flying at a constant speed to meet a target that moves with constant velocity, i.e. the
+// smallest positive t with |offset + velocity * t| = speed * t. the closed form solution is refined with a few
+// newton iterations, which fixes the precision loss when both speeds are almost equal. if the target can not be
+// caught within max_time, the time it takes to cover the current distance is returned instead, so the result is
+// always finite
+inline float get_intercept_time(float dx, float dy, float dz, float vx, float vy, float vz, float speed,
+                                float max_time = 3600.0f)
+{
+  // a * t^2 + 2 * b * t + c = 0
+  float a = vx * vx + vy * vy + vz * vz - speed * speed;
+  float b = dx * vx + dy * vy + dz * vz;
+  float c = dx * dx + dy * dy + dz * dz;
+
+  float discriminant = b * b - a * c;
+  float root = std::sqrt(std::max(discriminant, 0.0f));
+
+  // numerically stable form, c / q is the finite root when a goes to zero
+  float q = -(b + std::copysign(root, b));
+  float t0 = q / ((std::abs(a) > phi::EPSILON) ? a : std::copysign(phi::EPSILON, a));
+  float t1 = c / ((std::abs(q) > phi::EPSILON) ? q : std::copysign(phi::EPSILON, q));
+  float t_min = std::min(t0, t1), t_max = std::max(t0, t1);
+  float t = glm::clamp((t_min > 0.0f) ? t_min : t_max, -1.0f, max_time + 1.0f);
+
+  for (int i = 0; i < 2; i++) {
+    float x = dx + vx * t, y = dy + vy * t, z = dz + vz * t;
+    float distance = std::sqrt(x * x + y * y + z * z);
+    float f = distance - speed * t;
+    float df = (x * vx + y * vy + z * vz) / std::max(distance, phi::EPSILON) - speed;
+    t -= (std::abs(df) > phi::EPSILON) ? f / df : 0.0f;
+  }
+
+  float fallback = (speed > phi::EPSILON) ? std::sqrt(c) / speed : 0.0f;
+  bool valid = discriminant >= 0.0f && t > 0.0f && t <= max_time;
+  return valid ? t : fallback;
+}
+
+// point where a pursuer flying at its current speed meets the target
 glm::vec3 get_intercept_point(const glm::vec3& position, const glm::vec3& velocity, const glm::vec3& target_position,
                               const glm::vec3& target_velocity)
 {
-  auto velocity_delta = target_velocity - velocity;
-  auto position_delta = target_position - position;
-  auto time_to_intercept = glm::length(position_delta) / glm::length(velocity_delta);
+  auto offset = target_position - position;
+  auto speed = glm::length(velocity);
+  auto time_to_intercept = get_intercept_time(offset.x, offset.y, offset.z, target_velocity.x, target_velocity.y,
+                                              target_velocity.z, speed);
   return target_position + target_velocity * time_to_intercept;
 }
 
+// intercept solver for many pursuer/target pairs, stored in flat arrays and solved in a single loop over them
+class InterceptSolver
+{
+ public:
+  void clear()
+  {
+    for (auto* array : {&dx, &dy, &dz, &tx, &ty, &tz, &vx, &vy, &vz, &speed, &time}) array->clear();
+  }
+
+  int add(const glm::vec3& position, float pursuer_speed, const glm::vec3& target_position,
+          const glm::vec3& target_velocity)
+  {
+    auto offset = target_position - position;
+    dx.push_back(offset.x), dy.push_back(offset.y), dz.push_back(offset.z);
+    tx.push_back(target_position.x), ty.push_back(target_position.y), tz.push_back(target_position.z);
+    vx.push_back(target_velocity.x), vy.push_back(target_velocity.y), vz.push_back(target_velocity.z);
+    speed.push_back(pursuer_speed);
+    time.push_back(0.0f);
+    return static_cast<int>(time.size() - 1);
+  }
+
+  void solve()
+  {
+    const std::size_t count = time.size();
+    for (std::size_t i = 0; i < count; i++) {
+      time[i] = get_intercept_time(dx[i], dy[i], dz[i], vx[i], vy[i], vz[i], speed[i]);
+    }
+  }
+
+  std::size_t size() const { return time.size(); }
+
+  float get_time(int index) const { return time[index]; }
+
+  glm::vec3 get_point(int index) const
+  {
+    return glm::vec3(tx[index], ty[index], tz[index]) + glm::vec3(vx[index], vy[index], vz[index]) * time[index];
+  }
+
+ private:
+  std::vector<float> dx, dy, dz;  // offset from pursuer to target
+  std::vector<float> tx, ty, tz;  // target position
+  std::vector<float> vx, vy, vz;  // target velocity
+  std::vector<float> speed;       // pursuer speed
+  std::vector<float> time;        // time to intercept
+};
+
 void fly_towards(Airplane& airplane, const glm::vec3& target)
 {
   auto& rb = airplane;
@@ -42,3 +129,247 @@ void fly_towards(Airplane& airplane, const Airplane& target)
   fly_towards(airplane, point);
 }
 #endif
+
+// follow a route, e.g. from TerrainPlanner. index is the waypoint the airplane is flying to, it is advanced once
+// the airplane is within radius. returns false after the last waypoint was reached
+bool fly_waypoints(Airplane& airplane, const std::vector<glm::vec3>& waypoints, int& index, float radius = 500.0f)
+{
+  while (index < static_cast<int>(waypoints.size()) && glm::length(waypoints[index] - airplane.position) < radius) {
+    index++;
+  }
+
+  if (index >= static_cast<int>(waypoints.size())) return false;
+
+  fly_towards(airplane, waypoints[index]);
+  return true;
+}
+
+// batched version of fly_towards() for a fleet of npc aircraft. the state needed to steer is copied into flat
+// arrays, so update() never touches an Airplane and can run on a worker thread between physics steps. only
+// gather() and apply() must be called from the thread that owns the airplanes.
+class FleetAI
+{
+ public:
+  // add an aircraft that flies towards a fixed point
+  int add(Airplane* airplane, const glm::vec3& target)
+  {
+    airplanes.push_back(airplane);
+    chase.push_back(nullptr);
+    joystick.push_back(glm::vec4(0.0f));
+    for (auto* array : {&px, &py, &pz, &qw, &qx, &qy, &qz}) array->push_back(0.0f);
+    tx.push_back(target.x), ty.push_back(target.y), tz.push_back(target.z);
+    return static_cast<int>(airplanes.size() - 1);
+  }
+
+  // add an aircraft that tries to intercept another aircraft
+  int add(Airplane* airplane, const Airplane* target)
+  {
+    int index = add(airplane, target->position);
+    chase[index] = target;
+    return index;
+  }
+
+  void set_target(int index, const glm::vec3& target)
+  {
+    chase[index] = nullptr;
+    tx[index] = target.x, ty[index] = target.y, tz[index] = target.z;
+  }
+
+  void set_target(int index, const Airplane* target) { chase[index] = target; }
+
+  std::size_t size() const { return airplanes.size(); }
+
+  // copy aircraft state into the arrays
+  void gather()
+  {
+    intercept.clear();
+
+    for (std::size_t i = 0; i < airplanes.size(); i++) {
+      const Airplane* airplane = airplanes[i];
+      px[i] = airplane->position.x, py[i] = airplane->position.y, pz[i] = airplane->position.z;
+      qw[i] = airplane->rotation.w, qx[i] = airplane->rotation.x;
+      qy[i] = airplane->rotation.y, qz[i] = airplane->rotation.z;
+
+      if (chase[i] != nullptr) {
+        intercept.add(airplane->position, airplane->get_speed(), chase[i]->position, chase[i]->velocity);
+      }
+    }
+
+    intercept.solve();
+
+    for (std::size_t i = 0, pair = 0; i < airplanes.size(); i++) {
+      if (chase[i] != nullptr) {
+        auto point = intercept.get_point(static_cast<int>(pair++));
+        tx[i] = point.x, ty[i] = point.y, tz[i] = point.z;
+      }
+    }
+  }
+
+  // compute joystick commands for all aircraft in one pass
+  void update() { update(0, airplanes.size()); }
+
+  // compute joystick commands for the aircraft in [begin, end)
+  void update(std::size_t begin, std::size_t end)
+  {
+    const float m = phi::PI / 4.0f;
+
+    for (std::size_t i = begin; i < end; i++) {
+      float w = qw[i], x = qx[i], y = qy[i], z = qz[i];
+      float dx = tx[i] - px[i], dy = ty[i] - py[i], dz = tz[i] - pz[i];
+
+      // rotate into body space with the transposed rotation matrix, the rotation is a unit quaternion so this is
+      // the same as inverse_transform_direction() without the quaternion inverse
+      float bx = (1.0f - 2.0f * (y * y + z * z)) * dx + 2.0f * (x * y + w * z) * dy + 2.0f * (x * z - w * y) * dz;
+      float by = 2.0f * (x * y - w * z) * dx + (1.0f - 2.0f * (x * x + z * z)) * dy + 2.0f * (y * z + w * x) * dz;
+      float bz = 2.0f * (x * z + w * y) * dx + 2.0f * (y * z - w * x) * dy + (1.0f - 2.0f * (x * x + y * y)) * dz;
+
+      float inv_length = 1.0f / std::sqrt(std::max(bx * bx + by * by + bz * bz, phi::EPSILON));
+      bx *= inv_length, by *= inv_length, bz *= inv_length;
+
+      // angle between phi::FORWARD and the direction to the target
+      float angle = std::acos(glm::clamp(bx, -1.0f, 1.0f));
+
+      float rudder = bz;
+      float elevator = by * 5.0f;
+
+      float agressive_roll = bz;
+      float wings_level_roll = 2.0f * (y * z - w * x);  // right().y
+      float wings_level_influence = glm::clamp(angle, 0.0f, m) / m;
+      float aileron = wings_level_roll + wings_level_influence * (agressive_roll - wings_level_roll);
+
+      joystick[i] = glm::clamp(glm::vec4(aileron, rudder, elevator, 0.0f), glm::vec4(-1.0f), glm::vec4(1.0f));
+    }
+  }
+
+  // write joystick commands back to the aircraft
+  void apply()
+  {
+    for (std::size_t i = 0; i < airplanes.size(); i++) {
+      airplanes[i]->joystick = joystick[i];
+    }
+  }
+
+ private:
+  std::vector<Airplane*> airplanes;
+  std::vector<const Airplane*> chase;  // aircraft to intercept, may be nullptr
+  std::vector<glm::vec4> joystick;     // roll, yaw, pitch, elevator trim
+  std::vector<float> px, py, pz;       // position in world space
+  std::vector<float> qw, qx, qy, qz;   // rotation
+  std::vector<float> tx, ty, tz;       // target in world space
+  InterceptSolver intercept;
+};
+
+// time-sliced scheduling of ai agents. every agent has its own update rate, agents are spread out evenly over time
+// and the work per frame is capped by a cpu budget. agents that do not fit into the budget are deferred to the
+// next frame, where they are the first to run.
+class AIScheduler
+{
+ public:
+  struct Stats {
+    int updated = 0;             // agents updated in the last frame
+    int deferred = 0;            // agents that were due but did not fit into the budget
+    float time_used = 0.0f;      // microseconds spent in the last frame
+    float max_lateness = 0.0f;   // seconds the most overdue agent waited past its deadline
+    uint64_t total_updated = 0;  // since the scheduler was created
+    uint64_t total_deferred = 0;
+  };
+
+  float budget = 1000.0f;  // cpu budget per frame in microseconds
+  int chunk_size = 8;      // number of agents to update between checking the clock
+
+  // update rates in Hz
+  float combat_rate = 60.0f;
+  float near_rate = 20.0f;
+  float far_rate = 2.0f;
+
+  // distance to the player in meters where agents switch from near_rate to far_rate
+  float near_distance = 2000.0f;
+  float far_distance = 20000.0f;
+
+  int add(float rate)
+  {
+    int index = static_cast<int>(period.size());
+    period.push_back(1.0f / rate);
+
+    // spread the agents over one period with the golden ratio sequence so they don't all become due together
+    float phase = std::fmod(static_cast<float>(index) * 0.618034f, 1.0f);
+    next.push_back(time + period.back() * phase);
+    last.push_back(time);
+    return index;
+  }
+
+  void set_rate(int index, float rate)
+  {
+    period[index] = 1.0f / rate;
+    next[index] = std::min(next[index], last[index] + period[index]);
+  }
+
+  // agents in combat run at the full rate, the rest slows down with the distance to the player
+  void set_rate(int index, float distance, bool in_combat)
+  {
+    float t = phi::inverse_lerp(near_distance, far_distance, distance);
+    set_rate(index, in_combat ? combat_rate : phi::lerp(near_rate, far_rate, t));
+  }
+
+  std::size_t size() const { return period.size(); }
+
+  const Stats& get_stats() const { return stats; }
+
+  // advance the clock and call think(index, elapsed) for every agent that is due, most overdue agents first
+  template <typename Func>
+  void update(phi::Seconds dt, Func&& think)
+  {
+    using clock = std::chrono::steady_clock;
+    const auto start = clock::now();
+
+    time += dt;
+    stats.updated = stats.deferred = 0;
+    stats.max_lateness = 0.0f;
+
+    due.clear();
+    for (std::size_t i = 0; i < period.size(); i++) {
+      if (next[i] <= time) due.push_back(static_cast<int>(i));
+    }
+
+    std::sort(due.begin(), due.end(), [this](int a, int b) { return next[a] < next[b]; });
+
+    std::size_t i = 0;
+    float elapsed = 0.0f;
+
+    // the first chunk always runs so that agents make progress even if the budget is tiny
+    while (i < due.size() && (i == 0 || elapsed < budget)) {
+      std::size_t end = std::min(i + chunk_size, due.size());
+
+      for (; i < end; i++) {
+        int agent = due[i];
+        stats.max_lateness = std::max(stats.max_lateness, time - next[agent]);
+        think(agent, time - last[agent]);
+
+        // reschedule from now if the agent fell behind by more than one period
+        next[agent] += period[agent];
+        if (next[agent] <= time) next[agent] = time + period[agent];
+        last[agent] = time;
+      }
+
+      elapsed = std::chrono::duration<float, std::micro>(clock::now() - start).count();
+    }
+
+    for (std::size_t j = i; j < due.size(); j++) {
+      stats.max_lateness = std::max(stats.max_lateness, time - next[due[j]]);
+    }
+
+    stats.updated = static_cast<int>(i);
+    stats.deferred = static_cast<int>(due.size() - i);
+    stats.time_used = elapsed;
+    stats.total_updated += stats.updated;
+    stats.total_deferred += stats.deferred;
+  }
+
+ private:
+  phi::Seconds time = 0.0f;
+  std::vector<float> period;  // seconds between updates
+  std::vector<float> next;    // time of the next update
+  std::vector<float> last;    // time of the last update
+  std::vector<int> due;       // agents that are due in this frame
+  Stats stats;
+};
@@ -0,0 +1,204 @@
+/*
+    cascaded autopilot for any number of aircraft
+*/
+#pragma once
+
+#include <algorithm>
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "flightmodel.h"
+#include "pid.h"
+
+// the outer loops (altitude, heading, speed) run every few steps of the inner attitude loops and provide their
+// targets. both run at a fixed rate independent of the frame rate, so the gains behave the same at any fps
+class Autopilot
+{
+ public:
+  enum Mode : uint8_t {
+    OFF = 0,
+    ALTITUDE_HOLD = 1 << 0,
+    HEADING_HOLD = 1 << 1,
+    SPEED_HOLD = 1 << 2,
+    WAYPOINTS = 1 << 3,  // fly to the waypoints in order, sets the altitude and heading targets
+  };
+
+  float waypoint_radius = 1000.0f;  // distance at which a waypoint counts as reached, m
+
+  // the outer loops run at inner_rate / outer_divider
+  Autopilot(float inner_rate = 120.0f, int outer_divider = 8)
+      : inner(inner_rate), outer(inner_rate / static_cast<float>(outer_divider)), outer_divider(outer_divider)
+  {
+  }
+
+  // the airplane must outlive the autopilot
+  int add(Airplane* airplane, float max_pitch = 15.0f, float max_bank = 45.0f)
+  {
+    agents.push_back({.airplane = airplane,
+                      .altitude = airplane->position.y,
+                      .heading = get_heading(*airplane),
+                      .speed = airplane->get_speed(),
+                      .waypoints = {}});
+
+    // gains are in degrees, meters and meters per second
+    outer.add(0.05f, 0.002f, 0.05f, true, {-max_pitch, max_pitch}, 0.5f);  // altitude -> pitch
+    outer.add(1.5f, 0.0f, 0.5f, true, {-max_bank, max_bank}, 0.5f);        // heading -> bank
+    outer.add(0.05f, 0.02f, 0.0f, true, {0.0f, 1.0f});                     // speed -> throttle
+    inner.add(0.05f, 0.05f, 0.01f, true, {-1.0f, 1.0f}, 0.05f);            // pitch -> elevator
+    inner.add(0.005f, 0.0f, 0.001f, true, {-1.0f, 1.0f}, 0.05f);           // bank -> aileron
+    inner.add(0.05f, 0.0f, 0.0f, true, {-1.0f, 1.0f});                     // sideslip -> rudder
+
+    int i = static_cast<int>(agents.size() - 1);
+    set_mode(i, OFF);
+    return i;
+  }
+
+  std::size_t size() const { return agents.size(); }
+
+  void set_mode(int i, uint8_t mode)
+  {
+    agents[i].mode = mode;
+    bool pitch = mode & (ALTITUDE_HOLD | WAYPOINTS), roll = mode & (HEADING_HOLD | WAYPOINTS);
+    outer.set_enabled(LOOPS * i + ALTITUDE, pitch);
+    outer.set_enabled(LOOPS * i + HEADING, roll);
+    outer.set_enabled(LOOPS * i + SPEED, mode & SPEED_HOLD);
+    inner.set_enabled(LOOPS * i + PITCH, pitch);
+    inner.set_enabled(LOOPS * i + ROLL, roll);
+    inner.set_enabled(LOOPS * i + YAW, roll);
+  }
+
+  uint8_t get_mode(int i) const { return agents[i].mode; }
+
+  void set_altitude(int i, float altitude) { agents[i].altitude = altitude; }
+
+  // heading in degrees, 0 is along the x axis and 90 along the z axis
+  void set_heading(int i, float heading) { agents[i].heading = heading; }
+
+  void set_speed(int i, float speed) { agents[i].speed = speed; }
+
+  void set_waypoints(int i, const std::vector<glm::vec3>& waypoints)
+  {
+    agents[i].waypoints = waypoints;
+    agents[i].waypoint = 0;
+  }
+
+  // index of the waypoint the airplane is flying to
+  int get_waypoint(int i) const { return agents[i].waypoint; }
+
+  // runs as many fixed steps as fit in dt and returns the number of steps, the controls are held in between
+  int update(phi::Seconds dt, int max_steps = 8)
+  {
+    int steps = 0;
+    for (accumulator += dt; accumulator >= inner.timestep && steps < max_steps; accumulator -= inner.timestep) {
+      if (tick++ % outer_divider == 0) step_outer();
+      step_inner();
+      steps++;
+    }
+    accumulator = std::min(accumulator, inner.timestep);
+    return steps;
+  }
+
+  // heading in degrees, 0 is along the x axis and 90 along the z axis
+  static float get_heading(const Airplane& airplane)
+  {
+    auto forward = airplane.forward();
+    return glm::degrees(std::atan2(forward.z, forward.x));
+  }
+
+  // pitch in degrees, positive is nose up
+  static float get_pitch(const Airplane& airplane) { return glm::degrees(std::asin(airplane.forward().y)); }
+
+  // sideslip in degrees, positive when the air comes from the right
+  static float get_sideslip(const Airplane& airplane)
+  {
+    auto velocity = airplane.get_body_velocity();
+    float speed = glm::length(velocity);
+    return (speed > phi::EPSILON) ? glm::degrees(std::asin(velocity.z / speed)) : 0.0f;
+  }
+
+  // bank in degrees, positive is right wing down
+  static float get_bank(const Airplane& airplane)
+  {
+    return glm::degrees(std::atan2(-airplane.right().y, airplane.up().y));
+  }
+
+ private:
+  enum Loop { ALTITUDE = 0, HEADING = 1, SPEED = 2, PITCH = 0, ROLL = 1, YAW = 2, LOOPS = 3 };
+
+  struct Agent {
+    Airplane* airplane;
+    uint8_t mode = OFF;
+    float altitude, heading, speed;
+    std::vector<glm::vec3> waypoints;
+    int waypoint = 0;
+    float pitch = 0.0f, bank = 0.0f;  // targets of the inner loops
+  };
+
+  std::vector<Agent> agents;
+  PIDBank inner, outer;
+  const int outer_divider;
+  int tick = 0;
+  float accumulator = 0.0f;
+
+  void step_outer()
+  {
+    for (int i = 0; i < static_cast<int>(agents.size()); i++) {
+      auto& agent = agents[i];
+      const auto& airplane = *agent.airplane;
+
+      if ((agent.mode & WAYPOINTS) && !agent.waypoints.empty()) {
+        auto offset = agent.waypoints[agent.waypoint] - airplane.position;
+        if (glm::length(glm::vec2(offset.x, offset.z)) < waypoint_radius) {
+          agent.waypoint = (agent.waypoint + 1) % static_cast<int>(agent.waypoints.size());
+          offset = agent.waypoints[agent.waypoint] - airplane.position;
+        }
+        agent.altitude = agent.waypoints[agent.waypoint].y;
+        agent.heading = glm::degrees(std::atan2(offset.z, offset.x));
+      }
+
+      // the heading error is wrapped to [-180, 180] and fed as the value, so the derivative is still taken of it
+      float heading_error = std::remainder(agent.heading - get_heading(airplane), 360.0f);
+
+      outer.set(LOOPS * i + ALTITUDE, airplane.position.y, agent.altitude);
+      outer.set(LOOPS * i + HEADING, -heading_error, 0.0f);
+      outer.set(LOOPS * i + SPEED, airplane.get_speed(), agent.speed);
+    }
+
+    outer.step();
+
+    for (int i = 0; i < static_cast<int>(agents.size()); i++) {
+      agents[i].pitch = outer.get(LOOPS * i + ALTITUDE);
+      agents[i].bank = outer.get(LOOPS * i + HEADING);
+    }
+  }
+
+  void step_inner()
+  {
+    for (int i = 0; i < static_cast<int>(agents.size()); i++) {
+      const auto& agent = agents[i];
+      const auto& airplane = *agent.airplane;
+      inner.set(LOOPS * i + PITCH, get_pitch(airplane), agent.pitch);
+      inner.set(LOOPS * i + ROLL, get_bank(airplane), agent.bank);
+      inner.set(LOOPS * i + YAW, -get_sideslip(airplane), 0.0f);
+    }
+
+    inner.step();
+
+    // only the controls of the active modes are touched, the rest stays with the pilot
+    for (int i = 0; i < static_cast<int>(agents.size()); i++) {
+      auto& agent = agents[i];
+      auto& airplane = *agent.airplane;
+
+      if (agent.mode & (ALTITUDE_HOLD | WAYPOINTS)) {
+        airplane.joystick.z = inner.get(LOOPS * i + PITCH);
+      }
+      if (agent.mode & (HEADING_HOLD | WAYPOINTS)) {
+        airplane.joystick.x = inner.get(LOOPS * i + ROLL);
+        airplane.joystick.y = inner.get(LOOPS * i + YAW);
+      }
+      if (agent.mode & SPEED_HOLD) {
+        airplane.throttle = outer.get(LOOPS * i + SPEED);
+      }
+    }
+  }
+};
@@ -0,0 +1,385 @@
+/*
+    headless benchmarks for the simulation systems, run with a benchmark name or without arguments to run all
+*/
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <glm/gtc/matrix_transform.hpp>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "cdlod.h"
+#include "clipmap.h"
+#include "collider.h"
+#include "gpws.h"
+#include "phi.h"
+#include "pid.h"
+#include "planner.h"
+#include "projectile.h"
+
+using Clock = std::chrono::steady_clock;
+
+struct Timings {
+  double total = 0.0, max = 0.0;
+  int steps = 0;
+
+  void add(Clock::duration duration)
+  {
+    double us = std::chrono::duration<double, std::micro>(duration).count();
+    total += us, max = std::max(max, us), steps++;
+  }
+
+  void print(const char* name) const { printf("%-24s avg %8.1f us  max %8.1f us\n", name, total / steps, max); }
+};
+
+// targets flying in circles, shot at by each other with bursts of bullets and the odd missile
+void benchmark_projectiles()
+{
+  constexpr int TARGETS = 300, CAPACITY = 8192, STEPS = 60 * 30;
+  constexpr phi::Seconds DT = 1.0f / 60.0f;
+  constexpr float RATE_OF_FIRE = 100.0f;  // rounds per second per gun
+  constexpr int GUNS = 20;
+
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> random(-1.0f, 1.0f);
+
+  std::vector<phi::RigidBody> targets(TARGETS);
+  for (auto& rb : targets) {
+    rb.apply_gravity = false;
+    rb.position = glm::vec3(random(rng) * 5000.0f, 3000.0f + random(rng) * 1000.0f, random(rng) * 5000.0f);
+    rb.velocity = glm::vec3(random(rng), 0.0f, random(rng)) * 200.0f;
+  }
+
+  ProjectileSystem projectiles(CAPACITY);
+  Timings timings;
+  int hits = 0, dropped = 0, peak = 0;
+  float guns_reload = 0.0f;
+
+  for (int step = 0; step < STEPS; step++) {
+    for (auto& rb : targets) {
+      rb.add_force(glm::cross(glm::vec3(0.0f, 1.0f, 0.0f), rb.velocity) * 0.1f * rb.mass);
+      rb.update(DT);
+    }
+
+    auto start = Clock::now();
+
+    // each gun fires a short burst at the aircraft after it in the list
+    for (guns_reload += DT * RATE_OF_FIRE; guns_reload >= 1.0f; guns_reload -= 1.0f) {
+      for (int gun = 0; gun < GUNS; gun++) {
+        int shooter = (step * 7 + gun * 13) % TARGETS, target = (shooter + 1) % TARGETS;
+        const auto& rb = targets[shooter];
+        auto direction = glm::normalize(targets[target].position - rb.position);
+        auto spread = glm::vec3(random(rng), random(rng), random(rng)) * 0.01f;
+        dropped += !projectiles.fire(ProjectileSystem::BULLET, rb.position, rb.velocity + (direction + spread) * 1000.0f,
+                                     shooter, target);
+      }
+    }
+
+    if (step % 10 == 0) {
+      int shooter = step % TARGETS, target = (shooter + TARGETS / 2) % TARGETS;
+      const auto& rb = targets[shooter];
+      dropped += !projectiles.fire(ProjectileSystem::MISSILE, rb.position, rb.velocity, shooter, target);
+    }
+
+    projectiles.update(DT, targets, 10.0f);
+
+    timings.add(Clock::now() - start);
+    hits += static_cast<int>(projectiles.get_hits().size());
+    peak = std::max(peak, static_cast<int>(projectiles.size()));
+  }
+
+  timings.print("projectiles");
+  printf("  %d targets, peak %d projectiles, %d hits, %d dropped\n", TARGETS, peak, hits, dropped);
+}
+
+// pitch, roll, yaw, altitude and speed loops for a few hundred aircraft
+void benchmark_pid_bank()
+{
+  constexpr int AIRCRAFT = 500, LOOPS = 5, STEPS = 120 * 10;
+
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> random(-1.0f, 1.0f);
+
+  PIDBank bank(120.0f);
+  for (int i = 0; i < AIRCRAFT * LOOPS; i++) {
+    bank.add(1.0f + random(rng) * 0.5f, 0.1f, 0.05f, true, {-1.0f, 1.0f}, 0.05f);
+  }
+
+  std::vector<float> state(bank.size(), 0.0f);
+  Timings timings;
+
+  for (int step = 0; step < STEPS; step++) {
+    for (std::size_t i = 0; i < bank.size(); i++) {
+      bank.set(static_cast<int>(i), state[i], (step / 120) % 2 ? 1.0f : -1.0f);
+    }
+
+    auto start = Clock::now();
+    bank.step();
+    timings.add(Clock::now() - start);
+
+    for (std::size_t i = 0; i < bank.size(); i++) {
+      state[i] += bank.get(static_cast<int>(i)) * bank.timestep;
+    }
+  }
+
+  timings.print("pid bank");
+  printf("  %d controllers\n", static_cast<int>(bank.size()));
+}
+
+// terrain height under many points, e.g. every aircraft and projectile in a step
+void benchmark_heightmap()
+{
+  constexpr int SIZE = 1024, POINTS = 100000, STEPS = 100;
+
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> random(-1.0f, 1.0f);
+
+  std::vector<uint16_t> pixels(SIZE * SIZE);
+  for (auto& pixel : pixels) pixel = static_cast<uint16_t>(rng());
+  collider::Heightmap heightmap(pixels.data(), SIZE, SIZE, 1);
+
+  std::vector<glm::vec3> points(POINTS);
+  for (auto& point : points) point = glm::vec3(random(rng), 0.0f, random(rng)) * heightmap.magnification;
+
+  std::vector<float> heights;
+  std::vector<glm::vec3> normals;
+  Timings timings, normal_timings;
+  for (int step = 0; step < STEPS; step++) {
+    auto start = Clock::now();
+    heightmap.get_heights(points, heights);
+    timings.add(Clock::now() - start);
+
+    start = Clock::now();
+    heightmap.get_normals(points, normals);
+    normal_timings.add(Clock::now() - start);
+  }
+
+  timings.print("heightmap");
+  normal_timings.print("heightmap normals");
+  printf("  %d points\n", POINTS);
+}
+
+// rolling hills with some noise on top
+collider::Heightmap make_hills(int size, std::mt19937& rng)
+{
+  std::uniform_real_distribution<float> random(-1.0f, 1.0f);
+
+  std::vector<uint16_t> pixels(size * size);
+  for (int y = 0; y < size; y++) {
+    for (int x = 0; x < size; x++) {
+      float h = 0.4f + 0.2f * std::sin(x * 0.02f) * std::cos(y * 0.03f) + 0.1f * std::sin((x + y) * 0.11f);
+      pixels[y * size + x] = static_cast<uint16_t>(glm::clamp(h + 0.01f * random(rng), 0.0f, 1.0f) * 65535.0f);
+    }
+  }
+  return collider::Heightmap(pixels.data(), size, size, 1);
+}
+
+// line of sight and terrain lookahead segments, e.g. for every aircraft pair and every aircraft's flight path
+void benchmark_raycast()
+{
+  constexpr int SIZE = 1024, SEGMENTS = 10000, STEPS = 20;
+
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> random(-1.0f, 1.0f);
+
+  auto heightmap = make_hills(SIZE, rng);
+
+  auto start = Clock::now();
+  collider::HeightmapPyramid pyramid(heightmap);
+  Timings build;
+  build.add(Clock::now() - start);
+  build.print("raycast build");
+
+  std::vector<glm::vec3> from(SEGMENTS), to(SEGMENTS);
+  for (int i = 0; i < SEGMENTS; i++) {
+    from[i] = glm::vec3(random(rng) * 20000.0f, 1500.0f + random(rng) * 1000.0f, random(rng) * 20000.0f);
+    to[i] = from[i] + glm::vec3(random(rng) * 5000.0f, random(rng) * 1000.0f, random(rng) * 5000.0f);
+  }
+
+  std::vector<float> t;
+  Timings timings;
+  for (int step = 0; step < STEPS; step++) {
+    start = Clock::now();
+    pyramid.raycast(from, to, t);
+    timings.add(Clock::now() - start);
+  }
+  timings.print("raycast");
+
+  // the same segments marched in steps of a quarter texel
+  int march_hits = 0;
+  Timings march;
+  start = Clock::now();
+  for (int i = 0; i < SEGMENTS; i++) {
+    float length = glm::length(glm::vec2(to[i].x - from[i].x, to[i].z - from[i].z));
+    int samples = static_cast<int>(length * SIZE / (2.0f * heightmap.magnification) * 4.0f) + 1;
+    for (int j = 0; j <= samples; j++) {
+      auto p = glm::mix(from[i], to[i], static_cast<float>(j) / samples);
+      if (p.y <= heightmap.get_height({p.x, p.z})) {
+        march_hits++;
+        break;
+      }
+    }
+  }
+  march.add(Clock::now() - start);
+  march.print("raycast march");
+
+  int hits = static_cast<int>(std::count_if(t.begin(), t.end(), [](float x) { return x >= 0.0f; }));
+  printf("  %d segments, %d hits, %d hits marching\n", SEGMENTS, hits, march_hits);
+}
+
+// aircraft flying low over the hills in random directions, all checked in one batch per tick
+void benchmark_gpws()
+{
+  constexpr int SIZE = 1024, AIRCRAFT = 500, STEPS = 20;
+
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> random(-1.0f, 1.0f);
+
+  auto heightmap = make_hills(SIZE, rng);
+  collider::HeightmapPyramid pyramid(heightmap);
+  GroundProximity gpws(pyramid);
+
+  std::vector<phi::RigidBody> aircraft(AIRCRAFT);
+  for (auto& rb : aircraft) {
+    rb.position = glm::vec3(random(rng) * 20000.0f, 0.0f, random(rng) * 20000.0f);
+    rb.position.y = heightmap.get_height({rb.position.x, rb.position.z}) + 300.0f + random(rng) * 200.0f;
+    rb.velocity = glm::vec3(random(rng), random(rng) * 0.1f, random(rng)) * 250.0f;
+    gpws.add(&rb);
+  }
+
+  Timings timings;
+  for (int step = 0; step < STEPS; step++) {
+    auto start = Clock::now();
+    gpws.check();
+    timings.add(Clock::now() - start);
+  }
+  timings.print("gpws");
+
+  int cautions = 0, warnings = 0;
+  for (int i = 0; i < AIRCRAFT; i++) {
+    cautions += gpws.get_alert(i) == GroundProximity::CAUTION;
+    warnings += gpws.get_alert(i) == GroundProximity::WARNING;
+  }
+  printf("  %d aircraft, %d cautions, %d warnings\n", AIRCRAFT, cautions, warnings);
+}
+
+// a ridge with a gap and a mountain, the routes from one side to the other must go through the gap or around
+struct Ridge {
+  float get_height(const glm::vec2& p) const
+  {
+    bool in_ridge = std::abs(p.y) < 1500.0f && std::abs(p.x - 8000.0f) > 1500.0f && std::abs(p.x) < 20000.0f;
+    auto offset = p - glm::vec2(-5000.0f, 10000.0f);
+    return (in_ridge ? 2500.0f : 0.0f) + 3000.0f * std::exp(-glm::dot(offset, offset) / 1e7f);
+  }
+};
+
+void benchmark_planner()
+{
+  constexpr int AGENTS = 64;
+
+  TerrainPlanner planner(std::max(1u, std::thread::hardware_concurrency()));
+
+  auto start = Clock::now();
+  planner.build(Ridge{}, glm::vec2(0.0f), 25000.0f, 250.0f);
+  Timings build;
+  build.add(Clock::now() - start);
+  build.print("planner build");
+
+  start = Clock::now();
+  for (int i = 0; i < AGENTS; i++) {
+    auto from = glm::vec3(-20000.0f + i * 500.0f, 1000.0f, -15000.0f);
+    auto to = glm::vec3(15000.0f, 1000.0f, 15000.0f - (i % 40) * 300.0f);
+    planner.submit({.agent = i, .start = from, .goal = to, .ceiling = 2000.0f});
+  }
+
+  std::vector<TerrainPlanner::Plan> plans;
+  while (plans.size() < AGENTS) {
+    planner.poll(plans);
+    std::this_thread::yield();
+  }
+
+  Timings timings;
+  timings.add((Clock::now() - start) / AGENTS);
+  timings.print("planner plan");
+
+  int found = 0;
+  for (const auto& plan : plans) found += plan.found;
+  printf("  %d agents, %d routes found\n", AGENTS, found);
+}
+
+// terrain lod selection along a low flight over the hills, the rings of the clipmap against the cdlod quadtree
+void benchmark_terrain()
+{
+  constexpr int SIZE = 1024, STEPS = 360;
+
+  std::mt19937 rng(1);
+  auto heightmap = make_hills(SIZE, rng);
+  collider::HeightmapPyramid pyramid(heightmap);
+  auto bounds = [&pyramid](int, const glm::vec2& min, const glm::vec2& max, float* low, float* high) {
+    pyramid.bounds(min, max, low, high);
+  };
+
+  ClipmapLayout clipmap(16, 32, 2.0f);
+  CdlodQuadtree quadtree(16, 16, 4.0f);
+  const auto projection = glm::perspective(glm::radians(60.0f), 4.0f / 3.0f, 1.0f, 150000.0f);
+
+  Timings clipmap_timings, cdlod_timings;
+  std::size_t clipmap_triangles = 0, cdlod_triangles = 0;
+  for (int step = 0; step < STEPS; step++) {
+    float angle = glm::radians(static_cast<float>(step));
+    auto position = glm::vec3(std::cos(angle), 0.0f, std::sin(angle)) * 15000.0f;
+    float ground = heightmap.get_height({position.x, position.z});
+    position.y = ground + 300.0f;
+    auto forward = glm::vec3(-std::sin(angle), -0.1f, std::cos(angle));
+    collider::Frustum frustum(projection * glm::lookAt(position, position + forward, glm::vec3(0.0f, 1.0f, 0.0f)));
+
+    auto start = Clock::now();
+    clipmap.build(position, position.y - ground);
+    clipmap.cull(frustum, bounds);
+    clipmap_timings.add(Clock::now() - start);
+
+    for (int block = 0; block < ClipmapLayout::BLOCKS; block++) {
+      auto extent = clipmap.extent(static_cast<ClipmapLayout::Block>(block));
+      auto triangles = (block == ClipmapLayout::SEAM) ? extent.x / 2.0f : 2.0f * extent.x * extent.y;
+      clipmap_triangles += clipmap.get(static_cast<ClipmapLayout::Block>(block)).size() * std::size_t(triangles);
+    }
+
+    start = Clock::now();
+    quadtree.select(position, frustum, bounds);
+    cdlod_timings.add(Clock::now() - start);
+    cdlod_triangles += quadtree.get_triangles();
+  }
+
+  clipmap_timings.print("terrain clipmap");
+  cdlod_timings.print("terrain cdlod");
+  printf("  %zu triangles per frame with the clipmap, %zu with cdlod\n", clipmap_triangles / STEPS,
+         cdlod_triangles / STEPS);
+}
+
+struct Benchmark {
+  const char* name;
+  void (*run)();
+};
+
+const Benchmark benchmarks[] = {
+    {"projectiles", benchmark_projectiles},
+    {"pid", benchmark_pid_bank},
+    {"planner", benchmark_planner},
+    {"heightmap", benchmark_heightmap},
+    {"raycast", benchmark_raycast},
+    {"gpws", benchmark_gpws},
+    {"terrain", benchmark_terrain},
+};
+
+int main(int argc, char* argv[])
+{
+  for (const auto& benchmark : benchmarks) {
+    if (argc < 2 || strcmp(argv[1], benchmark.name) == 0) {
+      benchmark.run();
+    }
+  }
+
+  return 0;
+}
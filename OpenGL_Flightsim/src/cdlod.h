@@ -0,0 +1,154 @@
+/*
+    node selection of the cdlod quadtree terrain, without any gpu state
+*/
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "collider.h"
+
+// a node of the quadtree, drawn with the grid mesh or with one quarter of it
+struct CdlodNode {
+  glm::vec2 offset;  // world x and z of the corner with the smallest coordinates
+  float size;        // width of the whole node, m
+  float lod;
+};
+
+// continuous distance dependent level of detail. the terrain is a quadtree of square nodes, the nodes of lod 0 have
+// grid x grid segments of spacing and every lod doubles both. a node is drawn at its lod if it is out of the range of
+// the next finer lod, otherwise it is split and the children that are out of their own range are drawn as quarters of
+// it. nodes outside the frustum are skipped with all their children, their boxes reach from the lowest to the highest
+// terrain under them. the vertex shader morphs every lod into the grid of the next coarser one between morph_start *
+// range and range, so the lods match where they meet
+class CdlodQuadtree
+{
+ public:
+  enum Part : uint8_t {
+    WHOLE,
+    QUARTER_0,  // quarter i covers the half (i & 1) of the node along x and the half (i >> 1) along z
+    QUARTER_1,
+    QUARTER_2,
+    QUARTER_3,
+    PARTS,
+  };
+
+  const int lods;
+  const int grid;       // segments along one side of a node, even
+  const float spacing;  // of lod 0, m
+
+  float range = 150000.0f;   // distance the coarsest lod has to reach, m
+  float lod_factor = 4.0f;   // range of a lod in node sizes, large enough that only neighbouring lods meet
+  float morph_start = 0.7f;  // part of the range of a lod after which it morphs into the next coarser one
+
+  CdlodQuadtree(int lods, int grid, float spacing) : lods(lods), grid(grid), spacing(spacing) {}
+
+  float get_node_size(int lod) const { return grid * spacing * std::exp2(static_cast<float>(lod)); }
+
+  float get_range(int lod) const { return lod_factor * get_node_size(lod); }
+
+  // distances from the camera where the morph of a lod starts and ends
+  glm::vec2 get_morph(int lod) const { return glm::vec2(morph_start, 1.0f) * get_range(lod); }
+
+  // the lod of the roots, the finest one whose range reaches range
+  int get_coarsest_lod() const
+  {
+    int lod = 0;
+    while (lod < lods - 1 && get_range(lod) < range) lod++;
+    return lod;
+  }
+
+  // selects the nodes around the camera, the terrain under the rectangle of world x and z from min to max is given by
+  // bounds(lod, min, max, &low, &high)
+  template <typename Bounds>
+  void select(const glm::vec3& camera_pos, const collider::Frustum& frustum, Bounds bounds)
+  {
+    for (auto& list : nodes) list.clear();
+    camera = camera_pos;
+    culled = 0;
+
+    max_lod = get_coarsest_lod();
+
+    // the roots are the nodes of the coarsest lod within its range
+    const float size = get_node_size(max_lod), reach = get_range(max_lod);
+    const glm::vec2 camera_xz(camera.x, camera.z);
+    const glm::ivec2 lo = glm::ivec2(glm::floor((camera_xz - reach) / size));
+    const glm::ivec2 hi = glm::ivec2(glm::floor((camera_xz + reach) / size));
+    for (int j = lo.y; j <= hi.y; j++) {
+      for (int i = lo.x; i <= hi.x; i++) select_node(glm::vec2(i, j) * size, max_lod, frustum, bounds);
+    }
+  }
+
+  const std::vector<CdlodNode>& get(Part part) const { return nodes[part]; }
+
+  // nodes and quarters drawn, and nodes skipped with their children by the last select()
+  int get_drawn() const
+  {
+    int drawn = 0;
+    for (const auto& list : nodes) drawn += static_cast<int>(list.size());
+    return drawn;
+  }
+  int get_culled() const { return culled; }
+
+  // coarsest lod of the last select()
+  int get_max_lod() const { return max_lod; }
+
+  // triangles of the selected nodes
+  std::size_t get_triangles() const
+  {
+    std::size_t quarters = get_drawn() - nodes[WHOLE].size();
+    return (4 * nodes[WHOLE].size() + quarters) * std::size_t(grid) * grid / 2;
+  }
+
+ private:
+  std::array<std::vector<CdlodNode>, PARTS> nodes;
+  glm::vec3 camera = glm::vec3(0.0f);
+  int culled = 0;
+  int max_lod = 0;
+
+  // true if the node is drawn, culled or split, false if the parent has to draw its area
+  template <typename Bounds>
+  bool select_node(const glm::vec2& corner, int lod, const collider::Frustum& frustum, Bounds& bounds)
+  {
+    const float size = get_node_size(lod);
+    float low, high;
+    bounds(lod, corner, corner + size, &low, &high);
+    const glm::vec3 min(corner.x, low, corner.y), max(corner.x + size, high, corner.y + size);
+
+    if (!in_range(min, max, get_range(lod))) return false;
+    if (!is_visible(frustum, min, max)) {
+      culled++;
+      return true;
+    }
+
+    const CdlodNode node = {corner, size, static_cast<float>(lod)};
+    if (lod == 0 || !in_range(min, max, get_range(lod - 1))) {
+      nodes[WHOLE].push_back(node);
+      return true;
+    }
+
+    for (int q = 0; q < 4; q++) {
+      glm::vec2 child = corner + glm::vec2(q & 1, q >> 1) * (0.5f * size);
+      if (!select_node(child, lod - 1, frustum, bounds)) nodes[QUARTER_0 + q].push_back(node);
+    }
+    return true;
+  }
+
+  // the box from min to max intersects the sphere of radius r around the camera
+  bool in_range(const glm::vec3& min, const glm::vec3& max, float r) const
+  {
+    glm::vec3 d = glm::clamp(camera, min, max) - camera;
+    return glm::dot(d, d) <= r * r;
+  }
+
+  static bool is_visible(const collider::Frustum& frustum, const glm::vec3& min, const glm::vec3& max)
+  {
+    glm::vec3 center = 0.5f * (min + max), half = 0.5f * (max - min);
+    uint8_t visible;
+    collider::test_visibility(frustum, &center.x, &center.y, &center.z, &half.x, &half.y, &half.z, &visible, 1);
+    return visible;
+  }
+};
@@ -0,0 +1,454 @@
+/*
+    placement of the geometry clipmap blocks and the texels of the clipmap textures around the camera, without any gpu
+    state
+*/
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "collider.h"
+#include "streamer.h"
+
+// one block of the clipmap, the vertex shader scales the block, rotates it around the up axis and moves it to offset
+struct ClipmapInstance {
+  glm::vec2 offset;  // world x and z
+  float scale;
+  float rotation;  // around the up axis, radians
+  float level;     // level / levels
+};
+
+// every level is a ring of 5 x 5 positions around the finer levels, built from a few kinds of blocks. the instances
+// of each kind are collected for all levels, so the whole clipmap takes one instanced draw per kind. only the levels
+// between the finest one that is useful at the height above the ground and the coarsest one that reaches the far
+// plane are built, within a vertex budget. the vertex shader morphs the outer part of every level into the grid of
+// the next coarser one, so levels blend instead of popping
+class ClipmapLayout
+{
+ public:
+  enum Block : uint8_t {
+    TILE,    // segments x segments
+    CENTER,  // fills the hole of the finest level
+    FIXUP,   // segments x 2 between the tiles, rotated by 90 degrees in the columns
+    TRIM,    // one leg of the l shaped trim between a level and the finer one, the other leg is rotated by 90 degrees
+    SEAM,    // triangles that hide the cracks to the coarser level
+    BLOCKS,
+  };
+
+  const int levels;
+  const int segments;
+  const float segment_size;
+
+  std::size_t vertex_budget = 250000;  // vertices of all built levels before culling
+  float range = 150000.0f;             // distance the coarsest level has to reach, m
+  float height_factor = 2.5f;          // the finest ring is at least this many times wider than the height above ground
+
+  ClipmapLayout(int levels, int segments, float segment_size)
+      : levels(levels), segments(segments), segment_size(segment_size)
+  {
+  }
+
+  // places the blocks of the selected levels around the camera
+  void build(const glm::vec3& camera_pos, float height_above_ground)
+  {
+    for (auto& list : instances) list.clear();
+    select_levels(height_above_ground);
+
+    const int rows = 5, cols = 5;
+    const glm::vec2 camera_pos_xy(camera_pos.x, camera_pos.z);
+
+    for (int l = min_level; l <= max_level; l++) {
+      float scale = std::exp2(static_cast<float>(l));
+      float scaled_segment_size = segment_size * scale;
+      float tile_size = segments * scaled_segment_size;
+      float trim_size = extent(TRIM).x * scaled_segment_size;
+      float level = static_cast<float>(l) / levels;
+      auto base = calc_base(l, camera_pos_xy);
+
+      auto add = [&](Block block, const glm::vec2& offset, float angle = 0.0f) {
+        instances[block].push_back({offset, scale, glm::radians(angle), level});
+      };
+
+      if (l == min_level) {
+        add(CENTER, base + glm::vec2(tile_size, tile_size));
+      } else {
+        auto prev_base = calc_base(l - 1, camera_pos_xy);
+        auto diff = glm::abs(base - prev_base);
+
+        auto l_offset = glm::vec2(tile_size, tile_size);
+        if (diff.x == tile_size) {
+          l_offset.x += (2 * segments + 1) * scaled_segment_size;
+        }
+        add(TRIM, base + l_offset + glm::vec2(0.0f, trim_size), 90.0f);
+
+        auto v_offset = glm::vec2(tile_size, tile_size);
+        if (diff.y == tile_size) {
+          v_offset.y += (2 * segments + 1) * scaled_segment_size;
+        }
+        add(TRIM, base + v_offset);
+      }
+
+      glm::vec2 offset(0.0f);
+      for (int r = 0; r < rows; r++) {
+        offset.y = 0;
+        for (int c = 0; c < cols; c++) {
+          if (r == 0 || r == rows - 1 || c == 0 || c == cols - 1) {
+            auto tile_pos = base + offset;
+
+            if ((c != 2) && (r != 2)) {
+              if (c == 0 && r == 0) {  // east
+                add(SEAM, tile_pos);
+              } else if (c == cols - 1 && r == rows - 1) {  // west
+                add(SEAM, tile_pos + glm::vec2(tile_size), 180.0f);
+              } else if (c == cols - 1 && r == 0) {  // south
+                add(SEAM, tile_pos + glm::vec2(0, tile_size), 90.0f);
+              } else if (c == 0 && r == rows - 1) {  // north
+                add(SEAM, tile_pos + glm::vec2(tile_size, 0), -90.0f);
+              }
+              add(TILE, tile_pos);
+            } else if (c == 2) {
+              add(FIXUP, tile_pos);
+            } else if (r == 2) {
+              add(FIXUP, tile_pos + glm::vec2(0.0f, tile_size), 90.0f);
+            }
+          }
+
+          if (c == 2) {
+            offset.y += 2 * scaled_segment_size;
+          } else {
+            offset.y += tile_size;
+          }
+        }
+
+        if (r == 2) {
+          offset.x += 2 * scaled_segment_size;
+        } else {
+          offset.x += tile_size;
+        }
+      }
+    }
+  }
+
+  // removes the blocks outside the frustum. the box of a block reaches from the lowest to the highest terrain under
+  // it, given by bounds(level, min, max, &low, &high) for the rectangle of world x and z from min to max. the boxes of
+  // all blocks are tested in one batch
+  template <typename Bounds>
+  void cull(const collider::Frustum& frustum, Bounds bounds)
+  {
+    for (auto* v : {&center_x, &center_y, &center_z, &half_x, &half_y, &half_z}) v->clear();
+
+    for (int block = 0; block < BLOCKS; block++) {
+      glm::vec2 size = extent(static_cast<Block>(block)) * segment_size;
+      for (const auto& instance : instances[block]) {
+        // the blocks are rotated by multiples of 90 degrees around their corner
+        float c = std::cos(instance.rotation), s = std::sin(instance.rotation);
+        glm::vec2 x_axis = glm::vec2(c, -s) * size.x * instance.scale;
+        glm::vec2 z_axis = glm::vec2(s, c) * size.y * instance.scale;
+        glm::vec2 min = instance.offset + glm::min(x_axis, glm::vec2(0.0f)) + glm::min(z_axis, glm::vec2(0.0f));
+        glm::vec2 max = instance.offset + glm::max(x_axis, glm::vec2(0.0f)) + glm::max(z_axis, glm::vec2(0.0f));
+
+        // morphing moves vertices by up to one segment
+        min -= segment_size * instance.scale, max += segment_size * instance.scale;
+
+        float low, high;
+        bounds(std::ilogb(instance.scale), min, max, &low, &high);
+
+        center_x.push_back(0.5f * (min.x + max.x)), half_x.push_back(0.5f * (max.x - min.x));
+        center_y.push_back(0.5f * (low + high)), half_y.push_back(0.5f * (high - low));
+        center_z.push_back(0.5f * (min.y + max.y)), half_z.push_back(0.5f * (max.y - min.y));
+      }
+    }
+
+    visible.resize(center_x.size());
+    collider::test_visibility(frustum, center_x.data(), center_y.data(), center_z.data(), half_x.data(),
+                              half_y.data(), half_z.data(), visible.data(), visible.size());
+
+    std::size_t i = 0;
+    drawn = 0;
+    for (auto& list : instances) {
+      std::size_t kept = 0;
+      for (const auto& instance : list) {
+        if (visible[i++]) list[kept++] = instance;
+      }
+      list.resize(kept);
+      drawn += static_cast<int>(kept);
+    }
+    culled = static_cast<int>(visible.size()) - drawn;
+  }
+
+  const std::vector<ClipmapInstance>& get(Block block) const { return instances[block]; }
+
+  // blocks left and removed by the last cull()
+  int get_drawn() const { return drawn; }
+  int get_culled() const { return culled; }
+
+  // levels built by the last build()
+  int get_min_level() const { return min_level; }
+  int get_max_level() const { return max_level; }
+
+  // how far the finest level is morphed into the next coarser one, 1 right after it was added while descending and 0
+  // right before the next finer level is added
+  float get_min_morph() const { return min_morph; }
+
+  // the coarsest level that reaches range, and the finest level that is wide enough for the height above the ground
+  // and keeps all levels in between within the vertex budget
+  void select_levels(float height_above_ground)
+  {
+    max_level = 1;
+    while (max_level < levels && 0.5f * ring_width(max_level) < range) max_level++;
+
+    min_level = 1;
+    while (min_level < max_level && ring_width(min_level) < height_factor * height_above_ground) min_level++;
+    while (min_level < max_level && vertices(min_level, max_level) > vertex_budget) min_level++;
+
+    // the ring is between 1 and 2 times the wanted width when the height above ground selected the level
+    float ratio = ring_width(min_level) / std::max(height_factor * height_above_ground, 1.0f);
+    min_morph = glm::clamp(2.0f - ratio, 0.0f, 1.0f);
+  }
+
+  // width of the ring of a level, 4 tiles and the fixups between them, m
+  float ring_width(int level) const
+  {
+    return (4.0f * segments + 2.0f) * segment_size * std::exp2(static_cast<float>(level));
+  }
+
+  // vertices of the levels from finest to coarsest
+  std::size_t vertices(int finest, int coarsest) const
+  {
+    auto count = [this](Block block) {
+      auto e = extent(block);
+      return (block == SEAM) ? std::size_t(3 * e.x / 2) : std::size_t(e.x + 1) * std::size_t(e.y + 1);
+    };
+    std::size_t ring = 12 * count(TILE) + 4 * count(FIXUP) + 4 * count(SEAM);
+    std::size_t trims = 2 * count(TRIM);
+    return count(CENTER) + (coarsest - finest + 1) * ring + (coarsest - finest) * trims;
+  }
+
+  // size of a block along its local x and z in segments
+  glm::vec2 extent(Block block) const
+  {
+    const float n = static_cast<float>(segments), ring = 2.0f * segments + 2.0f;
+    switch (block) {
+      case TILE:
+        return {n, n};
+      case CENTER:
+        return {ring, ring};
+      case FIXUP:
+        return {n, 2.0f};
+      case TRIM:
+        return {ring, 1.0f};
+      case SEAM:
+        return {2.0f * ring, 0.0f};
+      default:
+        return {0.0f, 0.0f};
+    }
+  }
+
+ private:
+  std::array<std::vector<ClipmapInstance>, BLOCKS> instances;
+  int drawn = 0, culled = 0;
+  int min_level = 1, max_level = 1;
+  float min_morph = 0.0f;
+
+  // boxes of all blocks for the batched frustum test
+  std::vector<float> center_x, center_y, center_z, half_x, half_y, half_z;
+  std::vector<uint8_t> visible;
+
+  // corner of the ring of a level, snapped to the grid of the next coarser level so the rings nest
+  glm::vec2 calc_base(int level, glm::vec2 camera_pos) const
+  {
+    float scale = std::exp2(static_cast<float>(level));
+    float next_scale = std::exp2(static_cast<float>(level + 2));
+    float tile_size = segments * segment_size * scale;
+    glm::vec2 snapped = glm::floor(camera_pos / next_scale) * next_scale;
+    return snapped - tile_size * 2.0f;
+  }
+};
+
+// texels of the clipmap texture stack. level k holds size x size texels around the camera, texel (i, j) is the
+// terrain at world x and z (i, j) * get_spacing(k). the texels are stored toroidally at (i mod size, j mod size), so a
+// level is sampled at (position / spacing + 0.5) / size with repeat wrapping, and moving the camera only rewrites the
+// rows and columns that came into view. the texels are filled from the tiles in the streamer cache, the rewritten
+// regions are collected for the upload to the gpu
+class ClipmapTextures
+{
+ public:
+  // rectangle of texels in the storage of a level, does not wrap
+  struct Region {
+    int level, x, y, width, height;
+  };
+
+  const int size;
+  const int levels;
+  const float spacing;  // of level 0, m
+
+  ClipmapTextures(int size, int levels, float spacing)
+      : size(size),
+        levels(levels),
+        spacing(spacing),
+        heights(std::size_t(levels) * size * size),
+        normals(std::size_t(levels) * size * size * 4),
+        colors(std::size_t(levels) * size * size * 4),
+        origins(levels),
+        valid(levels, 0)
+  {
+  }
+
+  float get_spacing(int level) const { return spacing * std::exp2(static_cast<float>(level)); }
+
+  // moves the windows of the levels from first to last to the camera, and fills the texels that came into view and
+  // the ones covered by tiles that were loaded since the last update. the other levels are filled completely once
+  // they are used again
+  void update(const glm::vec2& camera_pos, int first, int last, const TerrainStreamer& streamer)
+  {
+    for (int level = 0; level < levels; level++) {
+      if (level < first || level > last) {
+        valid[level] = 0;
+        continue;
+      }
+
+      const glm::ivec2 origin = glm::ivec2(glm::floor(camera_pos / get_spacing(level))) - size / 2;
+      const glm::ivec2 end = origin + size;
+      const glm::ivec2 old = origins[level], delta = origin - old;
+      origins[level] = origin;
+
+      if (!valid[level] || std::abs(delta.x) >= size || std::abs(delta.y) >= size) {
+        fill(level, origin, end, streamer);
+        valid[level] = 1;
+        continue;
+      }
+
+      // the columns and then the rows that came into view
+      if (delta.x > 0) fill(level, {old.x + size, origin.y}, end, streamer);
+      if (delta.x < 0) fill(level, origin, {old.x, end.y}, streamer);
+      if (delta.y > 0) fill(level, {origin.x, old.y + size}, end, streamer);
+      if (delta.y < 0) fill(level, origin, {end.x, old.y}, streamer);
+
+      for (const auto& key : streamer.get_added()) {
+        const float half = 0.5f * streamer.get_size(key.zoom);
+        auto lo = glm::ivec2(glm::ceil((streamer.get_center(key) - half) / get_spacing(level)));
+        auto hi = glm::ivec2(glm::floor((streamer.get_center(key) + half) / get_spacing(level))) + 1;
+        fill(level, glm::max(lo, origin), glm::min(hi, end), streamer);
+      }
+    }
+  }
+
+  // regions rewritten since the last clear_regions()
+  const std::vector<Region>& get_regions() const { return regions; }
+  void clear_regions() { regions.clear(); }
+
+  // size x size texels of a level, heights are the normalized heightmap values, normals and colors are rgba
+  const uint16_t* get_heights(int level) const { return &heights[std::size_t(level) * size * size]; }
+  const uint8_t* get_normals(int level) const { return &normals[std::size_t(level) * size * size * 4]; }
+  const uint8_t* get_colors(int level) const { return &colors[std::size_t(level) * size * size * 4]; }
+
+  // range of the texels of a level under the rectangle of world x and z from min to max
+  void bounds(int level, const glm::vec2& min, const glm::vec2& max, uint16_t* low, uint16_t* high) const
+  {
+    const glm::ivec2 origin = origins[level];
+    auto lo = glm::max(glm::ivec2(glm::floor(min / get_spacing(level))), origin);
+    auto hi = glm::min(glm::ivec2(glm::ceil(max / get_spacing(level))), origin + size - 1);
+
+    *low = 0xFFFF, *high = 0;
+    const uint16_t* texels = get_heights(level);
+    for (int j = lo.y; j <= hi.y; j++) {
+      const uint16_t* row = &texels[wrap(j) * size];
+      for (int i = lo.x; i <= hi.x; i++) {
+        *low = std::min(*low, row[wrap(i)]);
+        *high = std::max(*high, row[wrap(i)]);
+      }
+    }
+    if (*low > *high) *low = *high = 0;
+  }
+
+ private:
+  std::vector<uint16_t> heights;
+  std::vector<uint8_t> normals, colors;
+  std::vector<glm::ivec2> origins;  // world texel coordinates of the first texel of every window
+  std::vector<uint8_t> valid;
+  std::vector<Region> regions;
+  std::vector<const TerrainTile*> tiles;
+
+  int wrap(int i) const { return ((i % size) + size) % size; }
+
+  // fills the texels from lo to hi, excluding hi, in world texel coordinates
+  void fill(int level, const glm::ivec2& lo, const glm::ivec2& hi, const TerrainStreamer& streamer)
+  {
+    if (lo.x >= hi.x || lo.y >= hi.y) return;
+
+    const float s = get_spacing(level);
+    streamer.find_tiles(glm::vec2(lo) * s, glm::vec2(hi - 1) * s, tiles);
+
+    const std::size_t first = std::size_t(level) * size * size;
+    for (int j = lo.y; j < hi.y; j++) {
+      for (int i = lo.x; i < hi.x; i++) {
+        std::size_t index = first + wrap(j) * size + wrap(i);
+        uint8_t* normal = &normals[4 * index];
+        uint8_t* color = &colors[4 * index];
+
+        // sea level where no tile is loaded
+        heights[index] = 0;
+        normal[0] = 0, normal[1] = 255, normal[2] = 0, normal[3] = 255;
+        color[0] = color[1] = color[2] = 0, color[3] = 255;
+
+        glm::vec2 position = glm::vec2(i, j) * s;
+        for (const auto* tile : tiles) {
+          float half = 0.5f * streamer.get_size(tile->key.zoom);
+          glm::vec2 uv = (position - streamer.get_center(tile->key)) / (2.0f * half) + 0.5f;
+          if (uv.x < 0.0f || uv.x > 1.0f || uv.y < 0.0f || uv.y > 1.0f || tile->heightmap.pixels.empty()) continue;
+
+          float value;
+          sample(tile->heightmap, uv, 1, &value);
+          heights[index] = static_cast<uint16_t>(value * 257.0f + 0.5f);
+          sample(tile->normalmap, uv, 3, normal);
+          sample(tile->texture, uv, 3, color);
+          break;
+        }
+      }
+    }
+
+    // the rectangle splits where it wraps around the storage
+    for (int y = lo.y; y < hi.y;) {
+      int height = std::min(hi.y - y, size - wrap(y));
+      for (int x = lo.x; x < hi.x;) {
+        int width = std::min(hi.x - x, size - wrap(x));
+        regions.push_back({level, wrap(x), wrap(y), width, height});
+        x += width;
+      }
+      y += height;
+    }
+  }
+
+  // bilinear lookup of the first components of an image at uv in [0, 1], clamped at the border. the image rows go
+  // from the smallest to the largest world z
+  static void sample(const Image& image, const glm::vec2& uv, int components, float* out)
+  {
+    components = std::min(components, image.channels);
+    if (components <= 0) return;
+
+    float x = glm::clamp(uv.x * image.width - 0.5f, 0.0f, image.width - 1.0f);
+    float y = glm::clamp(uv.y * image.height - 0.5f, 0.0f, image.height - 1.0f);
+    int x0 = static_cast<int>(x), y0 = static_cast<int>(y);
+    int x1 = std::min(x0 + 1, image.width - 1), y1 = std::min(y0 + 1, image.height - 1);
+    float fx = x - x0, fy = y - y0;
+
+    auto texel = [&](int tx, int ty, int c) {
+      return static_cast<float>(image.pixels[(ty * image.width + tx) * image.channels + c]);
+    };
+    for (int c = 0; c < components; c++) {
+      float top = texel(x0, y0, c) + (texel(x1, y0, c) - texel(x0, y0, c)) * fx;
+      float bottom = texel(x0, y1, c) + (texel(x1, y1, c) - texel(x0, y1, c)) * fx;
+      out[c] = top + (bottom - top) * fy;
+    }
+  }
+
+  static void sample(const Image& image, const glm::vec2& uv, int components, uint8_t* out)
+  {
+    float values[4];
+    sample(image, uv, components, values);
+    for (int c = 0; c < std::min(components, image.channels); c++) out[c] = static_cast<uint8_t>(values[c] + 0.5f);
+  }
+};
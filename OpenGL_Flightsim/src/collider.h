@@ -3,7 +3,15 @@
 */
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
 #include <glm/glm.hpp>
+#include <limits>
+#include <vector>
 
 #include "phi.h"
 
@@ -43,41 +51,433 @@ struct Ray : public Collider {
   inline glm::vec3 point_at(float t) const { return origin + direction * t; }
 };
 
+// planes of a view frustum, a point p is inside if dot(plane, vec4(p, 1)) >= 0 for all of them
+struct Frustum {
+  glm::vec4 planes[6];
+
+  Frustum(const glm::mat4& view_projection)
+  {
+    auto row = [&](int i) {
+      return glm::vec4(view_projection[0][i], view_projection[1][i], view_projection[2][i], view_projection[3][i]);
+    };
+    for (int i = 0; i < 3; i++) {
+      planes[2 * i + 0] = row(3) + row(i);
+      planes[2 * i + 1] = row(3) - row(i);
+    }
+  }
+};
+
+// cpu heightmap for collision queries. it covers center +- magnification along x and z, the texture coordinates are the
+// position mapped to [0, 1] and filtered bilinearly with repeat wrapping, and the terrain outside has height 0. the
+// streamed terrain keeps one per loaded tile, centered on the tile and with the border texels of the tile repeated
+// once around it, so magnification is half the tile width plus one texel and the lookups inside the tile are clamped
+// at its border like the ones that fill the texture stack. the heights are stored as 16 bit values in tiles of
+// TILE x TILE texels, so the four texels of a bilinear lookup are almost always in the same one or two cache lines
 struct Heightmap {
-  const uint8_t* data;
-  const int width, height, channels;
-  const float scale = 3000.0f, shift = 0.0f;
+  static constexpr int TILE = 8;
+
+  std::vector<uint16_t> data;  // tiled, use texel() to read
+  int width = 0, height = 0;
+  float scale = 3000.0f, shift = 0.0f;  // height = scale * normalized value + shift
 
-  float magnification = 25000.0f;
+  float magnification = 25000.0f;     // half the width of the heightmap, m
+  glm::vec2 center = glm::vec2(0.0f);  // world x and z of the middle of the heightmap
 
-  Heightmap(const uint8_t* data, int width, int height, int channels)
-      : data(data), width(width), height(height), channels(channels)
+  Heightmap() = default;
+
+  // from a decoded 8 bit image, only the first channel is used
+  Heightmap(const uint8_t* pixels, int width, int height, int channels) : Heightmap(width, height)
   {
+    for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) data[index(x, y)] = pixels[(y * width + x) * channels] * 257;
+    }
   }
 
-  glm::vec3 sample(const glm::vec2& coord) const
+  // from a decoded 16 bit image, only the first channel is used
+  Heightmap(const uint16_t* pixels, int width, int height, int channels) : Heightmap(width, height)
   {
-    assert(0.0f <= coord.x && coord.x <= 1.0f);
-    assert(0.0f <= coord.y && coord.y <= 1.0f);
-
-    int x = static_cast<int>(width * coord.x);
-    int y = static_cast<int>(height * coord.y);
+    for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) data[index(x, y)] = pixels[(y * width + x) * channels];
+    }
+  }
 
-    int index = (y * width + x) * channels;
+  uint16_t texel(int x, int y) const { return data[index(x, y)]; }
 
-    auto color = glm::vec3{static_cast<float>(data[index + 0]), static_cast<float>(data[index + 1]),
-                           static_cast<float>(data[index + 2])};
-    color /= 255.0f;
-    return color;
+  // normalized value at texture coordinates, texel centers are at (i + 0.5) / size and the coordinates repeat like
+  // on the gpu
+  float sample(const glm::vec2& coord) const
+  {
+    return bilinear(coord.x - std::floor(coord.x), coord.y - std::floor(coord.y));
   }
 
   float get_height(const glm::vec2& coord) const
   {
-    glm::vec2 tmp = glm::clamp(coord / magnification, glm::vec2(-1.0f), glm::vec2(1.0f));
-    auto uv = phi::scale(tmp, glm::vec2(-1.0f), glm::vec2(1.0f), glm::vec2(0.0f), glm::vec2(1.0f));
-    float value = sample(uv).r;
-    float height = scale * value + shift;
-    return height;
+    const float to_uv = 0.5f / magnification;
+    return height_at((coord.x - center.x) * to_uv + 0.5f, (coord.y - center.y) * to_uv + 0.5f);
+  }
+
+  // surface normal of the bilinear patch under the point
+  glm::vec3 get_normal(const glm::vec2& coord) const
+  {
+    const float to_uv = 0.5f / magnification;
+    return normal_at((coord.x - center.x) * to_uv + 0.5f, (coord.y - center.y) * to_uv + 0.5f);
+  }
+
+  // batched get_height() for count points, x and z are read with the given stride in floats, so both arrays of
+  // glm::vec3 and separate arrays can be passed
+  void get_heights(const float* x, const float* z, float* heights, std::size_t count, std::size_t stride = 1) const
+  {
+    const float to_uv = 0.5f / magnification;
+    for (std::size_t i = 0; i < count; i++) {
+      heights[i] = height_at((x[i * stride] - center.x) * to_uv + 0.5f, (z[i * stride] - center.y) * to_uv + 0.5f);
+    }
+  }
+
+  void get_heights(const std::vector<glm::vec3>& points, std::vector<float>& heights) const
+  {
+    heights.resize(points.size());
+    if (!points.empty()) get_heights(&points[0].x, &points[0].z, heights.data(), points.size(), 3);
+  }
+
+  // batched get_normal(), same layout as get_heights()
+  void get_normals(const float* x, const float* z, glm::vec3* normals, std::size_t count, std::size_t stride = 1) const
+  {
+    const float to_uv = 0.5f / magnification;
+    for (std::size_t i = 0; i < count; i++) {
+      normals[i] = normal_at((x[i * stride] - center.x) * to_uv + 0.5f, (z[i * stride] - center.y) * to_uv + 0.5f);
+    }
+  }
+
+  void get_normals(const std::vector<glm::vec3>& points, std::vector<glm::vec3>& normals) const
+  {
+    normals.resize(points.size());
+    if (!points.empty()) get_normals(&points[0].x, &points[0].z, normals.data(), points.size(), 3);
+  }
+
+ private:
+  int tiles_x = 0;  // tiles per row
+
+  Heightmap(int width, int height)
+      : data(tiles(width) * tiles(height) * TILE * TILE), width(width), height(height), tiles_x(tiles(width))
+  {
+  }
+
+  static int tiles(int size) { return (size + TILE - 1) / TILE; }
+
+  int index(int x, int y) const
+  {
+    unsigned ux = x, uy = y;
+    return ((uy / TILE) * tiles_x + ux / TILE) * (TILE * TILE) + (uy % TILE) * TILE + ux % TILE;
+  }
+
+  // an empty heightmap is flat
+  bool inside(float u, float v) const { return !data.empty() && u >= 0.0f && u <= 1.0f && v >= 0.0f && v <= 1.0f; }
+
+  float height_at(float u, float v) const { return inside(u, v) ? scale * bilinear(u, v) + shift : 0.0f; }
+
+  // corners of the bilinear lookup at (u, v) in [0, 1] and the position inside the cell they span. the texels at
+  // the border are blended with the opposite border like with GL_REPEAT
+  void corners(float u, float v, float* h, float* fx, float* fy) const
+  {
+    // x and y are at least -0.5, so truncating x + 1 is the same as flooring it
+    float x = u * width + 0.5f, y = v * height + 0.5f;
+    int x1 = static_cast<int>(x), y1 = static_cast<int>(y);
+    *fx = x - static_cast<float>(x1), *fy = y - static_cast<float>(y1);
+
+    int x0 = x1 - 1, y0 = y1 - 1;
+    x0 += (x0 < 0) ? width : 0, y0 += (y0 < 0) ? height : 0;
+    x1 -= (x1 >= width) ? width : 0, y1 -= (y1 >= height) ? height : 0;
+
+    h[0] = texel(x0, y0), h[1] = texel(x1, y0);
+    h[2] = texel(x0, y1), h[3] = texel(x1, y1);
+  }
+
+  float bilinear(float u, float v) const
+  {
+    float h[4], fx, fy;
+    corners(u, v, h, &fx, &fy);
+    float top = h[0] + (h[1] - h[0]) * fx, bottom = h[2] + (h[3] - h[2]) * fx;
+    return (top + (bottom - top) * fy) * (1.0f / 65535.0f);
+  }
+
+  glm::vec3 normal_at(float u, float v) const
+  {
+    if (!inside(u, v)) return glm::vec3(0.0f, 1.0f, 0.0f);
+
+    float h[4], fx, fy;
+    corners(u, v, h, &fx, &fy);
+
+    // derivatives of the bilinear patch in height per texel, converted to height per meter
+    float dx = (h[1] - h[0]) * (1.0f - fy) + (h[3] - h[2]) * fy;
+    float dz = (h[2] - h[0]) * (1.0f - fx) + (h[3] - h[1]) * fx;
+    float to_height = scale / 65535.0f;
+    float texel_x = 2.0f * magnification / width, texel_z = 2.0f * magnification / height;
+    return glm::normalize(glm::vec3(-dx * to_height / texel_x, 1.0f, -dz * to_height / texel_z));
+  }
+};
+
+// min/max mip pyramid of a heightmap for ray queries. level 0 holds the bounds of the bilinear patch between four
+// texel centers, every level above the bounds of up to 2x2 nodes of the level below. rays descend only into the
+// nodes whose bounding box they hit, front to back, and skip everything behind the closest hit so far. the heightmap
+// must outlive the pyramid. the terrain outside the grid is not tested
+class HeightmapPyramid
+{
+ public:
+  HeightmapPyramid(const Heightmap& heightmap) : heightmap(heightmap) { build(); }
+
+  // rebuilds the pyramid after the heightmap changed, an empty heightmap has no terrain to hit
+  void build()
+  {
+    levels.clear();
+    int w = heightmap.width - 1, h = heightmap.height - 1;
+    if (w <= 0 || h <= 0) return;
+
+    Level base{.width = w, .height = h, .min = std::vector<uint16_t>(w * h), .max = std::vector<uint16_t>(w * h)};
+    for (int y = 0; y < h; y++) {
+      for (int x = 0; x < w; x++) {
+        auto h00 = heightmap.texel(x, y), h10 = heightmap.texel(x + 1, y);
+        auto h01 = heightmap.texel(x, y + 1), h11 = heightmap.texel(x + 1, y + 1);
+        base.min[y * w + x] = std::min({h00, h10, h01, h11});
+        base.max[y * w + x] = std::max({h00, h10, h01, h11});
+      }
+    }
+    levels.push_back(std::move(base));
+
+    while (levels.back().width > 1 || levels.back().height > 1) {
+      const auto& below = levels.back();
+      int lw = (below.width + 1) / 2, lh = (below.height + 1) / 2;
+      Level level{.width = lw, .height = lh, .min = std::vector<uint16_t>(lw * lh, 0xFFFF),
+                  .max = std::vector<uint16_t>(lw * lh, 0)};
+      for (int y = 0; y < below.height; y++) {
+        for (int x = 0; x < below.width; x++) {
+          int i = (y / 2) * lw + x / 2;
+          level.min[i] = std::min(level.min[i], below.min[y * below.width + x]);
+          level.max[i] = std::max(level.max[i], below.max[y * below.width + x]);
+        }
+      }
+      levels.push_back(std::move(level));
+    }
+  }
+
+  // closest hit of origin + direction * t with the terrain raised by lift, for t in [0, max_t]
+  bool raycast(const glm::vec3& origin, const glm::vec3& direction, float max_t, float* t, float lift = 0.0f) const
+  {
+    if (levels.empty()) return false;
+
+    // grid space has the texel centers at integer coordinates, t is the same in both spaces
+    const glm::vec3 to_grid(heightmap.width / (2.0f * heightmap.magnification), 1.0f,
+                            heightmap.height / (2.0f * heightmap.magnification));
+    const glm::vec3 center(heightmap.center.x, 0.0f, heightmap.center.y);
+    const glm::vec3 grid_center(0.5f * heightmap.width - 0.5f, 0.0f, 0.5f * heightmap.height - 0.5f);
+    const glm::vec3 o = (origin - center) * to_grid + grid_center;
+    const glm::vec3 d = direction * to_grid;
+    const glm::vec3 inverse_d = 1.0f / d;
+
+    const float height_scale = heightmap.scale / 65535.0f, height_shift = heightmap.shift + lift;
+
+    struct Node {
+      int level, x, y;
+      float t_enter, t_exit;
+    };
+
+    // every level pushes at most 4 nodes
+    std::array<Node, 4 * 24> stack;
+    int top = 0;
+
+    bool hit = false;
+
+    auto push = [&](int level, int x, int y) {
+      const auto& l = levels[level];
+      if (x >= l.width || y >= l.height) return;
+
+      // the terrain is solid, so the box of a node reaches all the way down. nodes at the far border of a level
+      // cover fewer cells
+      float size = static_cast<float>(1 << level);
+      glm::vec3 min(x * size, std::numeric_limits<float>::lowest(), y * size);
+      glm::vec3 max(std::min((x + 1) * size, static_cast<float>(heightmap.width - 1)),
+                    l.max[y * l.width + x] * height_scale + height_shift,
+                    std::min((y + 1) * size, static_cast<float>(heightmap.height - 1)));
+
+      float t_enter, t_exit;
+      if (!slab_test(o, inverse_d, min, max, &t_enter, &t_exit) || t_exit < 0.0f || t_enter > max_t) return;
+      t_enter = std::max(t_enter, 0.0f);
+
+      // entering the node below its lowest point is a hit without descending any further
+      if (o.y + d.y * t_enter <= l.min[y * l.width + x] * height_scale + height_shift) {
+        max_t = t_enter, hit = true;
+        return;
+      }
+      stack[top++] = {level, x, y, t_enter, t_exit};
+    };
+
+    // start at the smallest node that contains the part of the ray inside the grid instead of the root
+    int level = static_cast<int>(levels.size()) - 1, x = 0, y = 0;
+    if (std::isfinite(max_t)) {
+      const glm::vec3 grid_max(heightmap.width - 2, 0.0f, heightmap.height - 2);
+      glm::ivec3 a(glm::clamp(o, glm::vec3(0.0f), grid_max));
+      glm::ivec3 b(glm::clamp(o + d * max_t, glm::vec3(0.0f), grid_max));
+      int bits = std::bit_width(static_cast<unsigned>((a.x ^ b.x) | (a.z ^ b.z)));
+      if (bits < level) level = bits, x = a.x >> bits, y = a.z >> bits;
+    }
+    push(level, x, y);
+
+    while (top > 0) {
+      Node node = stack[--top];
+      if (node.t_enter > max_t) continue;  // behind a closer hit
+
+      if (node.level == 0) {
+        float t_hit;
+        float t_exit = std::min(node.t_exit, max_t);
+        if (intersect_patch(o, d, node.x, node.y, node.t_enter, t_exit, height_scale, height_shift, &t_hit)) {
+          max_t = t_hit, hit = true;
+        }
+        continue;
+      }
+
+      // the children are sorted far to near, so the nearest is visited first and the others are skipped once it hits
+      int first = top;
+      for (int i = 0; i < 4; i++) push(node.level - 1, node.x * 2 + (i & 1), node.y * 2 + (i >> 1));
+      for (int i = first + 1; i < top; i++) {
+        for (int j = i; j > first && stack[j - 1].t_enter < stack[j].t_enter; j--) std::swap(stack[j - 1], stack[j]);
+      }
+    }
+
+    if (hit) *t = max_t;
+    return hit;
+  }
+
+  // batched segment queries, t[i] is in [0, 1] along from[i] -> to[i], or -1 if the segment does not hit the
+  // terrain raised by lift
+  void raycast(const std::vector<glm::vec3>& from, const std::vector<glm::vec3>& to, std::vector<float>& t,
+               float lift = 0.0f) const
+  {
+    assert(from.size() == to.size());
+    t.resize(from.size());
+    for (std::size_t i = 0; i < from.size(); i++) {
+      if (!raycast(from[i], to[i] - from[i], 1.0f, &t[i], lift)) t[i] = -1.0f;
+    }
+  }
+
+  // conservative range of the terrain heights over the rectangle of world x and z from min to max, the terrain
+  // outside the heightmap is at height 0
+  void bounds(const glm::vec2& min, const glm::vec2& max, float* low, float* high) const
+  {
+    *low = *high = 0.0f;
+    if (levels.empty()) return;
+
+    const glm::vec2 to_grid(heightmap.width / (2.0f * heightmap.magnification),
+                            heightmap.height / (2.0f * heightmap.magnification));
+    const glm::vec2 grid_center(0.5f * heightmap.width - 0.5f, 0.5f * heightmap.height - 0.5f);
+    const glm::vec2 g0 = (min - heightmap.center) * to_grid + grid_center;
+    const glm::vec2 g1 = (max - heightmap.center) * to_grid + grid_center;
+    const auto& base = levels.front();
+
+    // texel i covers grid coordinates i +- 0.5
+    if (g1.x < -0.5f || g1.y < -0.5f || g0.x > heightmap.width - 0.5f || g0.y > heightmap.height - 0.5f) return;
+
+    // the border half texels blend with the opposite border, so only the global bounds are safe there
+    bool inside = g0.x >= 0.0f && g0.y >= 0.0f && g1.x <= base.width && g1.y <= base.height;
+    int x0 = 0, y0 = 0, x1 = 0, y1 = 0, level = static_cast<int>(levels.size()) - 1;
+    if (inside) {
+      x0 = static_cast<int>(g0.x), y0 = static_cast<int>(g0.y);
+      x1 = std::min(static_cast<int>(g1.x), base.width - 1), y1 = std::min(static_cast<int>(g1.y), base.height - 1);
+
+      // a level where the rectangle covers at most about 4 x 4 nodes
+      unsigned cells = static_cast<unsigned>(std::max(x1 - x0, y1 - y0));
+      level = std::min(level, static_cast<int>(std::bit_width(cells / 4)));
+      x0 >>= level, y0 >>= level, x1 >>= level, y1 >>= level;
+    }
+
+    const auto& l = levels[level];
+    uint16_t lo = 0xFFFF, hi = 0;
+    for (int y = y0; y <= y1; y++) {
+      for (int x = x0; x <= x1; x++) {
+        lo = std::min(lo, l.min[y * l.width + x]);
+        hi = std::max(hi, l.max[y * l.width + x]);
+      }
+    }
+
+    const float height_scale = heightmap.scale / 65535.0f;
+    *low = lo * height_scale + heightmap.shift;
+    *high = hi * height_scale + heightmap.shift;
+    if (!inside) *low = std::min(*low, 0.0f), *high = std::max(*high, 0.0f);
+  }
+
+  // batched line of sight, visible[i] is 1 if the terrain does not block from[i] -> to[i]
+  void line_of_sight(const std::vector<glm::vec3>& from, const std::vector<glm::vec3>& to,
+                     std::vector<uint8_t>& visible) const
+  {
+    assert(from.size() == to.size());
+    visible.resize(from.size());
+    float t;
+    for (std::size_t i = 0; i < from.size(); i++) visible[i] = !raycast(from[i], to[i] - from[i], 1.0f, &t);
+  }
+
+ private:
+  struct Level {
+    int width, height;
+    std::vector<uint16_t> min, max;
+  };
+
+  const Heightmap& heightmap;
+  std::vector<Level> levels;
+
+  static bool slab_test(const glm::vec3& origin, const glm::vec3& inverse_direction, const glm::vec3& min,
+                        const glm::vec3& max, float* t_enter, float* t_exit)
+  {
+    glm::vec3 t0 = (min - origin) * inverse_direction, t1 = (max - origin) * inverse_direction;
+    glm::vec3 near = glm::min(t0, t1), far = glm::max(t0, t1);
+    *t_enter = std::max(std::max(near.x, near.y), near.z);
+    *t_exit = std::min(std::min(far.x, far.y), far.z);
+    return *t_enter <= *t_exit;
+  }
+
+  // first root in [t0, t1] of the ray against the bilinear patch of cell (x, y) in grid space
+  bool intersect_patch(const glm::vec3& o, const glm::vec3& d, int x, int y, float t0, float t1, float height_scale,
+                       float height_shift, float* t) const
+  {
+    float h00 = heightmap.texel(x, y) * height_scale + height_shift;
+    float h10 = heightmap.texel(x + 1, y) * height_scale + height_shift;
+    float h01 = heightmap.texel(x, y + 1) * height_scale + height_shift;
+    float h11 = heightmap.texel(x + 1, y + 1) * height_scale + height_shift;
+
+    // height along the ray h(t) = h0 + h1 t + h2 t^2, with the cell relative coordinates u = u0 + du t, v = v0 + dv t
+    float b = h10 - h00, c = h01 - h00, e = h00 - h10 - h01 + h11;
+    float u0 = o.x - x, v0 = o.z - y;
+    float h0 = h00 + b * u0 + c * v0 + e * u0 * v0;
+    float h1 = b * d.x + c * d.z + e * (u0 * d.z + v0 * d.x);
+    float h2 = e * d.x * d.z;
+
+    // roots of the ray height minus the terrain height, the ray is above the terrain where it is positive
+    float qa = -h2, qb = d.y - h1, qc = o.y - h0;
+    auto above = [&](float s) { return (qa * s + qb) * s + qc; };
+
+    if (above(t0) <= 0.0f) {
+      *t = t0;
+      return true;
+    }
+
+    float roots[2];
+    int count = 0;
+    if (std::abs(qa) < 1e-12f) {
+      if (qb != 0.0f) roots[count++] = -qc / qb;
+    } else {
+      float discr = qb * qb - 4.0f * qa * qc;
+      if (discr < 0.0f) return false;
+      // numerically stable form, avoids cancellation when qb is large
+      float q = -0.5f * (qb + std::copysign(std::sqrt(discr), qb));
+      roots[count++] = q / qa;
+      if (q != 0.0f) roots[count++] = qc / q;
+      if (count == 2 && roots[1] < roots[0]) std::swap(roots[0], roots[1]);
+    }
+
+    for (int i = 0; i < count; i++) {
+      if (roots[i] >= t0 && roots[i] <= t1) {
+        *t = roots[i];
+        return true;
+      }
+    }
+    return false;
   }
 };
 
@@ -124,12 +524,55 @@ bool test_collision(const AABB& a, const AABB& b)
           (a_max.z < b_min.z || a_min.z > b_max.z));
 }
 
+// test a batch of boxes against a frustum, the boxes are given by their centers and half sizes in separate arrays.
+// visible[i] is 1 if box i is at least partly inside. conservative near the corners of the frustum
+void test_visibility(const Frustum& frustum, const float* center_x, const float* center_y, const float* center_z,
+                     const float* half_x, const float* half_y, const float* half_z, uint8_t* visible,
+                     std::size_t count)
+{
+  for (std::size_t i = 0; i < count; i++) visible[i] = 1;
+
+  for (const auto& plane : frustum.planes) {
+    const float nx = plane.x, ny = plane.y, nz = plane.z, d = plane.w;
+    const float ax = std::abs(nx), ay = std::abs(ny), az = std::abs(nz);
+    for (std::size_t i = 0; i < count; i++) {
+      // distance of the box corner furthest along the plane normal
+      float distance = nx * center_x[i] + ny * center_y[i] + nz * center_z[i] + d + ax * half_x[i] +
+                       ay * half_y[i] + az * half_z[i];
+      visible[i] &= static_cast<uint8_t>(distance >= 0.0f);
+    }
+  }
+}
+
 bool test_collision(const Heightmap& heightmap, const glm::vec3& point, float* height)
 {
   *height = heightmap.get_height({point.x, point.z});
   return point.y <= *height;
 }
 
+// test collision between a ray and the terrain, t is in multiples of the ray direction
+bool test_collision(const HeightmapPyramid& terrain, const Ray& r, float max_t, float* t)
+{
+  return terrain.raycast(r.origin, r.direction, max_t, t);
+}
+
+// test collision between the line segment a -> b and the terrain, t is in [0, 1]
+bool test_collision(const HeightmapPyramid& terrain, const glm::vec3& a, const glm::vec3& b, float* t)
+{
+  return terrain.raycast(a, b - a, 1.0f, t);
+}
+
+// test collision of a moving sphere with the terrain. the terrain is raised by the radius, which is exact on flat
+// ground and conservative on slopes
+bool test_moving_collision(const HeightmapPyramid& terrain, const Sphere& s, const glm::vec3& velocity,
+                           float* t = nullptr)
+{
+  float tmp_t;
+  if (!terrain.raycast(s.center, velocity, 1.0f, &tmp_t, s.radius)) return false;
+  if (t != nullptr) *t = tmp_t;
+  return true;
+}
+
 // test collision of two moving spheres
 bool test_moving_collision(const Sphere& s0, const glm::vec3& velocity0, const Sphere& s1, const glm::vec3& velocity1,
                            float* t = nullptr)
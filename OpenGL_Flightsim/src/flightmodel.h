@@ -2,12 +2,12 @@
 
 #include <algorithm>
 #include <cmath>
+#include <glm/gtc/matrix_transform.hpp>
 #include <limits>
 #include <tuple>
 #include <vector>
 
 #include "data.h"
-#include "gfx.h"
 #include "phi.h"
 
 #define LOG_FLIGHT 0
@@ -66,6 +66,8 @@ Shader::Shader(const std::string& vertShader, const std::string& fragShader)
   }
   glDeleteShader(vertexShader);
   glDeleteShader(fragmentShader);
+
+  reflect();
 }
 
 Shader::~Shader() { glDeleteProgram(id); }
@@ -74,50 +76,98 @@ void Shader::bind() const { glUseProgram(id); }
 
 void Shader::unbind() const { glUseProgram(0); }
 
-void Shader::uniform(const std::string& name, int value) { glUniform1i(glGetUniformLocation(id, name.c_str()), value); }
-
-void Shader::uniform(const std::string& name, unsigned int value)
+void Shader::reflect()
 {
-  glUniform1ui(glGetUniformLocation(id, name.c_str()), value);
+  locations.clear();
+
+  GLint count = 0, max_length = 0;
+  glGetProgramiv(id, GL_ACTIVE_UNIFORMS, &count);
+  glGetProgramiv(id, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_length);
+  std::string name(std::max(max_length, 1), '\0');
+
+  auto add = [this](const std::string& name) {
+    GLint location = glGetUniformLocation(id, name.c_str());
+    if (location < 0) return;  // in a uniform block
+    if (!locations.emplace(hash(name), location).second) std::cout << "uniform hash collision: " << name << std::endl;
+  };
+
+  for (GLint i = 0; i < count; i++) {
+    GLsizei length = 0;
+    GLint size = 0;
+    GLenum type = 0;
+    glGetActiveUniform(id, i, static_cast<GLsizei>(name.size()), &length, &size, &type, name.data());
+    std::string uniform = name.substr(0, length);
+
+    // arrays are reported by their first element
+    if (uniform.size() > 3 && uniform.compare(uniform.size() - 3, 3, "[0]") == 0) {
+      std::string base = uniform.substr(0, uniform.size() - 3);
+      add(base);
+      for (GLint element = 1; element < size; element++) add(base + "[" + std::to_string(element) + "]");
+    }
+    add(uniform);
+  }
+
+  const std::pair<const char*, GLuint> blocks[] = {{"Camera", CAMERA_BLOCK}, {"Lights", LIGHTS_BLOCK}};
+  for (const auto& [block, binding] : blocks) {
+    GLuint index = glGetUniformBlockIndex(id, block);
+    if (index != GL_INVALID_INDEX) glUniformBlockBinding(id, index, binding);
+  }
 }
 
-void Shader::uniform(const std::string& name, float value)
+void Shader::uniform(std::string_view name, int value) { glUniform1i(location(name), value); }
+
+void Shader::uniform(std::string_view name, unsigned int value) { glUniform1ui(location(name), value); }
+
+void Shader::uniform(std::string_view name, float value) { glUniform1f(location(name), value); }
+
+void Shader::uniform(std::string_view name, const glm::vec2& value) { glUniform2fv(location(name), 1, &value[0]); }
+
+void Shader::uniform(std::string_view name, const glm::vec3& value) { glUniform3fv(location(name), 1, &value[0]); }
+
+void Shader::uniform(std::string_view name, const glm::vec4& value) { glUniform4fv(location(name), 1, &value[0]); }
+
+void Shader::uniform(std::string_view name, const glm::mat4& value)
 {
-  glUniform1f(glGetUniformLocation(id, name.c_str()), value);
+  glUniformMatrix4fv(location(name), 1, GL_FALSE, &value[0][0]);
 }
 
-void Shader::uniform(const std::string& name, const glm::vec3& value)
+void Shader::uniform(std::string_view name, const glm::vec2* values, int count)
 {
-  glUniform3fv(glGetUniformLocation(id, name.c_str()), 1, &value[0]);
+  glUniform2fv(location(name), count, &values[0][0]);
 }
 
-void Shader::uniform(const std::string& name, const glm::vec4& value)
+UniformBuffer::UniformBuffer(std::size_t size, GLuint binding)
 {
-  glUniform4fv(glGetUniformLocation(id, name.c_str()), 1, &value[0]);
+  glGenBuffers(1, &id);
+  glBindBuffer(GL_UNIFORM_BUFFER, id);
+  glBufferData(GL_UNIFORM_BUFFER, size, nullptr, GL_DYNAMIC_DRAW);
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  glBindBufferBase(GL_UNIFORM_BUFFER, binding, id);
 }
 
-void Shader::uniform(const std::string& name, const glm::mat4& value)
+UniformBuffer::~UniformBuffer() { glDeleteBuffers(1, &id); }
+
+void UniformBuffer::update(const void* data, std::size_t size)
 {
-  glUniformMatrix4fv(glGetUniformLocation(id, name.c_str()), 1, GL_FALSE, &value[0][0]);
+  glBindBuffer(GL_UNIFORM_BUFFER, id);
+  glBufferSubData(GL_UNIFORM_BUFFER, 0, size, data);
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
 }
 
 Texture::Texture(const std::string& path) : Texture(path, {}) {}
 
 unsigned char* Texture::load_image(const std::string path, int* width, int* height, int* channels, bool flip)
 {
-  stbi_set_flip_vertically_on_load(flip);
+  // per thread, images are also decoded on the terrain streaming threads
+  stbi_set_flip_vertically_on_load_thread(flip);
   return stbi_load(path.c_str(), width, height, channels, 0);
 }
 
+void Texture::free_image(unsigned char* data) { stbi_image_free(data); }
+
 Texture::Texture(const std::string& path, const TextureParams& params)
 {
   glGenTextures(1, &id);
-  glBindTexture(GL_TEXTURE_2D, id);
-
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, params.texture_wrap);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, params.texture_wrap);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, params.texture_min_filter);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, params.texture_mag_filter);
 
   // glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
   // glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
@@ -129,18 +179,30 @@ Texture::Texture(const std::string& path, const TextureParams& params)
   // printf("channels = %d\n", channels);
 
   if (data) {
-    auto format = get_format(channels);
-
-    // std::cout  << path << ": format = " << format << ", channels = " <<
-    // channels << std::endl;
-    glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-    glGenerateMipmap(GL_TEXTURE_2D);
+    upload(data, width, height, channels, params);
   } else {
     std::cout << "Failed to load texture" << std::endl;
   }
   stbi_image_free(data);
 }
 
+void Texture::upload(const unsigned char* data, int width, int height, int channels, const TextureParams& params)
+{
+  glBindTexture(GL_TEXTURE_2D, id);
+
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, params.texture_wrap);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, params.texture_wrap);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, params.texture_min_filter);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, params.texture_mag_filter);
+
+  auto format = get_format(channels);
+
+  // std::cout  << path << ": format = " << format << ", channels = " <<
+  // channels << std::endl;
+  glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
+  glGenerateMipmap(GL_TEXTURE_2D);
+}
+
 Texture::~Texture() { glDeleteTextures(1, &id); }
 
 void Texture::bind(GLuint texture) const
@@ -176,6 +238,34 @@ GLint Texture::get_format(int channels)
 
 void Texture::set_parameteri(GLenum target, GLenum pname, GLint param) { glTexParameteri(target, pname, param); }
 
+TextureArray::TextureArray(int width, int height, int layers, GLint internal_format, GLenum format, GLenum type,
+                           const TextureParams& params)
+    : format(format), type(type)
+{
+  glBindTexture(GL_TEXTURE_2D_ARRAY, id);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, params.texture_wrap);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, params.texture_wrap);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, params.texture_min_filter);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, params.texture_mag_filter);
+  glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, internal_format, width, height, layers, 0, format, type, nullptr);
+}
+
+void TextureArray::bind(GLuint texture) const
+{
+  glActiveTexture(GL_TEXTURE0 + texture);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, id);
+}
+
+void TextureArray::unbind() const { glBindTexture(GL_TEXTURE_2D_ARRAY, 0); }
+
+void TextureArray::update(int layer, int x, int y, int width, int height, const void* data, int row_length)
+{
+  glBindTexture(GL_TEXTURE_2D_ARRAY, id);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, row_length);
+  glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, x, y, layer, width, height, 1, format, type, data);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
 CubemapTexture::CubemapTexture(const std::array<std::string, 6>& paths, bool flip_vertically)
 {
   glGenTextures(1, &id);
@@ -183,15 +273,14 @@ CubemapTexture::CubemapTexture(const std::array<std::string, 6>& paths, bool fli
 
   int width, height, channels;
   for (int i = 0; i < 6; i++) {
-    stbi_set_flip_vertically_on_load(flip_vertically);
-    unsigned char* data = stbi_load(paths[i].c_str(), &width, &height, &channels, 0);
+    unsigned char* data = load_image(paths[i], &width, &height, &channels, flip_vertically);
     if (data) {
       auto format = get_format(channels);
       glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-      stbi_image_free(data);
+      free_image(data);
     } else {
       std::cout << "Cubemap tex failed to load at path: " << paths[i] << std::endl;
-      stbi_image_free(data);
+      free_image(data);
     }
   }
   glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
@@ -217,10 +306,10 @@ void VertexBuffer::bind() const { glBindBuffer(GL_ARRAY_BUFFER, id); }
 
 void VertexBuffer::unbind() const { glBindBuffer(GL_ARRAY_BUFFER, 0); }
 
-void VertexBuffer::buffer(const void* data, size_t size)
+void VertexBuffer::buffer(const void* data, size_t size, GLenum usage)
 {
   bind();
-  glBufferData(GL_ARRAY_BUFFER, size, data, GL_STATIC_DRAW);
+  glBufferData(GL_ARRAY_BUFFER, size, data, usage);
 }
 
 VertexArrayObject::VertexArrayObject() { glGenVertexArrays(1, &id); }
@@ -247,37 +336,42 @@ void ElementBufferObject::buffer(const void* data, size_t size)
 };  // namespace gl
 
 Geometry::Geometry(const std::vector<float>& vertices, const VertexLayout& layout)
-    : triangle_count(static_cast<int>(vertices.size()) / (get_stride(layout)))
+    : triangle_count(static_cast<int>(vertices.size()) / (get_stride(layout))), m_layout(layout)
 {
-  const int stride = get_stride(layout);
-
   vao.bind();
   vbo.buffer(vertices);
+  set_attributes();
+  vbo.unbind();
+  vao.bind();
+}
+
+void Geometry::set_attributes()
+{
+  const int stride = get_stride(m_layout);
+
+  vbo.bind();
 
   unsigned int index = 0;
   glVertexAttribPointer(index, 3, GL_FLOAT, GL_FALSE, stride * sizeof(float), (void*)0);
   glEnableVertexAttribArray(index);
 
-  if (layout == POS_NORM || layout == POS_NORM_UV)  // add normal
+  if (m_layout == POS_NORM || m_layout == POS_NORM_UV)  // add normal
   {
     index++;
     glVertexAttribPointer(index, 3, GL_FLOAT, GL_FALSE, stride * sizeof(float), (void*)(3 * sizeof(float)));
     glEnableVertexAttribArray(index);
   }
 
-  if (layout == POS_UV || layout == POS_NORM_UV)  // add uv
+  if (m_layout == POS_UV || m_layout == POS_NORM_UV)  // add uv
   {
     index++;
     glVertexAttribPointer(index, 2, GL_FLOAT, GL_FALSE, stride * sizeof(float),
                           (void*)(static_cast<int>(index) * 3 * sizeof(float)));
     glEnableVertexAttribArray(index);
   }
-
-  vbo.unbind();
-  vao.bind();
 }
 
-Geometry::Geometry(const Geometry& geometry) { triangle_count = geometry.triangle_count; }
+Geometry::Geometry(const Geometry& geometry) : m_layout(geometry.m_layout) { triangle_count = geometry.triangle_count; }
 
 Geometry::~Geometry() {}
 
@@ -316,20 +410,11 @@ std::shared_ptr<gl::Shader> MaterialX<Derived>::shader = nullptr;
 
 int Object3D::counter = 0;
 
-void Object3D::draw(RenderContext& context)
-{
-  if (visible) {
-    draw_self(context);
-  }
-  draw_children(context);
-}
+unsigned Object3D::hierarchy = 0;
 
-void Object3D::draw_self(RenderContext& context) {}
+int Material::counter = 0;
 
-void Object3D::draw_children(RenderContext& context)
-{
-  for (auto child : children) child->draw(context);
-}
+void Object3D::draw_self(RenderContext& context) {}
 
 glm::vec3 Object3D::get_position() const { return m_position; }
 
@@ -372,7 +457,11 @@ void Object3D::set_rotation(const glm::vec3& rot)
 
 void Object3D::rotate_by(const glm::vec3& rot) { set_rotation(get_rotation() + rot); }
 
-void Object3D::set_rotation_quat(const glm::quat& quat) { m_rotation = quat; }
+void Object3D::set_rotation_quat(const glm::quat& quat)
+{
+  m_rotation = quat;
+  m_dirty_dof = true;
+}
 
 glm::mat4 Object3D::get_local_transform() const
 {
@@ -399,51 +488,11 @@ void Object3D::override_transform(const glm::mat4& matrix)
   // TODO: relcalculate position, rotation etc
 }
 
-void Object3D::update_world_matrix(bool dirty_parent)
-{
-  bool dirty = m_dirty_dof || dirty_parent;
-
-  if (dirty && !m_dirty_transform) {
-    if (parent)
-      transform = get_parent_transform() * get_local_transform();
-    else
-      transform = get_local_transform();
-  }
-
-  for (auto child : children) {
-    child->update_world_matrix(dirty || m_dirty_transform);
-  }
-
-  m_dirty_dof = m_dirty_transform = false;
-}
-
-glm::mat4 Object3D::get_parent_transform() const
-{
-  assert(parent != nullptr);
-
-  if (transform_flags == (OBJ3D_TRANSFORM | OBJ3D_ROTATE | OBJ3D_SCALE)) {
-    return parent->transform;
-  }
-
-  glm::mat4 parent_transform(1.0f);
-
-  if (transform_flags & OBJ3D_TRANSFORM) {
-    parent_transform *= glm::translate(glm::mat4(1.0f), parent->get_world_position());
-  }
-  if (transform_flags & OBJ3D_ROTATE) {
-    parent_transform *= glm::toMat4(parent->get_world_rotation_quat());
-  }
-  if (transform_flags & OBJ3D_SCALE) {
-    parent_transform *= glm::scale(glm::mat4(1.0f), parent->get_scale());
-  }
-
-  return parent_transform;
-}
-
 Object3D& Object3D::add(Object3D* child)
 {
   child->parent = this;
   children.push_back(child);
+  hierarchy++;
   return (*this);
 }
 
@@ -470,9 +519,88 @@ glm::mat4 Light::light_space_matrix()
   return light_projection * light_view;
 }
 
+void SceneGraph::build(Object3D& scene)
+{
+  if (root == &scene && version == Object3D::hierarchy) return;
+  root = &scene, version = Object3D::hierarchy;
+
+  objects.clear(), parents.clear(), lights.clear(), cameras.clear();
+
+  // depth first with the children in order, the same order as Object3D::traverse
+  std::vector<std::pair<Object3D*, int>> stack = {{&scene, -1}};
+  while (!stack.empty()) {
+    auto [obj, parent] = stack.back();
+    stack.pop_back();
+
+    const int index = static_cast<int>(objects.size());
+    objects.push_back(obj);
+    parents.push_back(parent);
+    obj->m_dirty_dof = true;  // the arrays are filled by the next update
+
+    if (obj->get_type() == Object3D::Type::LIGHT) lights.push_back(static_cast<Light*>(obj));
+    if (obj->get_type() == Object3D::Type::CAMERA) cameras.push_back(static_cast<Camera*>(obj));
+
+    for (auto it = obj->children.rbegin(); it != obj->children.rend(); ++it) stack.push_back({*it, index});
+  }
+
+  const std::size_t n = objects.size();
+  flags.resize(n), positions.resize(n), scales.resize(n), rotations.resize(n), world_rotations.resize(n);
+  world.resize(n), dirty.resize(n), overridden.resize(n);
+}
+
+void SceneGraph::update()
+{
+  const std::size_t n = objects.size();
+
+  // copies the local transforms that changed
+  for (std::size_t i = 0; i < n; i++) {
+    Object3D* obj = objects[i];
+    dirty[i] = obj->m_dirty_dof, overridden[i] = obj->m_dirty_transform;
+    if (dirty[i]) {
+      flags[i] = obj->transform_flags;
+      positions[i] = obj->m_position, rotations[i] = obj->m_rotation, scales[i] = obj->m_scale;
+    }
+    if (overridden[i]) world[i] = obj->transform;
+    obj->m_dirty_dof = obj->m_dirty_transform = false;
+  }
+
+  // the parents are updated before their children
+  constexpr unsigned inherit_all = OBJ3D_TRANSFORM | OBJ3D_ROTATE | OBJ3D_SCALE;
+  for (std::size_t i = 0; i < n; i++) {
+    const int p = parents[i];
+    if (p >= 0 && dirty[p]) dirty[i] = true;
+    if (!dirty[i]) continue;
+
+    world_rotations[i] = (p >= 0) ? world_rotations[p] * rotations[i] : rotations[i];
+    if (overridden[i]) continue;
+
+    glm::mat4 local = glm::translate(glm::mat4(1.0f), positions[i]) * glm::toMat4(rotations[i]) *
+                      glm::scale(glm::mat4(1.0f), scales[i]);
+    if (p < 0) {
+      world[i] = local;
+    } else if (flags[i] == inherit_all) {
+      world[i] = world[p] * local;
+    } else {
+      // only some parts of the world transform of the parent, its scale is the local one
+      glm::mat4 parent(1.0f);
+      if (flags[i] & OBJ3D_TRANSFORM) parent *= glm::translate(glm::mat4(1.0f), glm::vec3(world[p][3]));
+      if (flags[i] & OBJ3D_ROTATE) parent *= glm::toMat4(world_rotations[p]);
+      if (flags[i] & OBJ3D_SCALE) parent *= glm::scale(glm::mat4(1.0f), scales[p]);
+      world[i] = parent * local;
+    }
+  }
+
+  // copies the world matrices that changed
+  for (std::size_t i = 0; i < n; i++) {
+    if (dirty[i]) objects[i]->transform = world[i];
+  }
+}
+
 void Renderer::render(Camera& camera, Object3D& scene)
 {
-  scene.update_world_matrix(false);
+  graph.build(scene);
+  graph.update();
+  stats = {};
 
   RenderContext context;
   context.camera = &camera;
@@ -480,25 +608,32 @@ void Renderer::render(Camera& camera, Object3D& scene)
   context.shadow_caster = nullptr;
   context.background_color = background;
 
-  scene.traverse([&context](Object3D* obj) {
-    if (obj->get_type() == Object3D::Type::LIGHT) {
-      Light* light = dynamic_cast<Light*>(obj);
-      context.lights.push_back(light);
-
-      if (light->cast_shadow) {
-        context.shadow_caster = light;
-      }
-    }
+  context.lights = graph.get_lights();
+  for (auto light : context.lights) {
+    if (light->cast_shadow) context.shadow_caster = light;
+  }
 
-    return true;
-  });
+  // the camera and the lights are the same for all draws of the frame
+  CameraBlock camera_data = {.view = camera.get_view_matrix(),
+                             .projection = camera.get_projection_matrix(),
+                             .position = glm::vec4(camera.get_world_position(), 1.0f)};
+  camera_block.update(&camera_data, sizeof(camera_data));
+
+  LightsBlock lights_data = {};
+  lights_data.count = static_cast<int32_t>(std::min<std::size_t>(context.lights.size(), MAX_LIGHTS));
+  for (int i = 0; i < lights_data.count; i++) {
+    lights_data.lights[i].type = context.lights[i]->type;
+    lights_data.lights[i].color = context.lights[i]->rgb;
+    lights_data.lights[i].position = context.lights[i]->get_world_position();
+  }
+  lights_block.update(&lights_data, sizeof(lights_data));
 
   if (shadow_map && context.shadow_caster) {
     context.is_shadow_pass = true;
     glViewport(0, 0, shadow_map->width, shadow_map->height);
     glBindFramebuffer(GL_FRAMEBUFFER, shadow_map->fbo);
     glClear(GL_DEPTH_BUFFER_BIT);
-    scene.draw(context);
+    draw(context);
   }
 
   context.is_shadow_pass = false;
@@ -509,62 +644,141 @@ void Renderer::render(Camera& camera, Object3D& scene)
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 #if 1
-  scene.draw(context);
+  draw(context);
 #else
-  screen_quad->draw(context);
+  queue.begin(glm::vec3(0.0f));
+  screen_quad->enqueue(queue, context);
+  queue.submit(context, stats);
 #endif
 }
 
-void Mesh::draw_self(RenderContext& context)
+void Renderer::draw(RenderContext& context)
 {
-  glm::mat4 lightSpaceMatrix(1.0f);
+  queue.begin(context.camera->get_world_position());
+  for (auto obj : graph.get_objects()) {
+    if (obj->visible) obj->enqueue(queue, context);
+  }
+  queue.submit(context, stats);
+}
 
-  if (context.is_shadow_pass) {
-    assert(context.shadow_caster);
+void RenderQueue::begin(const glm::vec3& position)
+{
+  camera_pos = position;
+  packets.clear();
+  keys.clear();
+}
 
-    gl::Shader* shader = &context.shadow_map->shader;
+void RenderQueue::add(Object3D* object, Pass pass) { push(object, nullptr, nullptr, uint64_t(pass) << 60); }
 
-    shader->bind();
-    shader->uniform("u_Model", transform);
-    shader->uniform("u_LightSpaceMatrix", context.shadow_caster->light_space_matrix());
-  } else {
-    gl::Shader* shader = m_material->get_shader();
+void RenderQueue::add(Object3D* object, Material* material, Geometry* geometry)
+{
+  const gl::Shader* shader = material->get_shader();
+  const gl::Texture* texture = material->get_texture();
+  // 4 bits pass, 8 bits shader, 12 bits material, 12 bits texture and 28 bits depth
+  uint64_t key = uint64_t(SCENE) << 60;
+  key |= uint64_t(shader ? shader->id & 0xFFU : 0U) << 52;
+  key |= uint64_t(material->id & 0xFFF) << 40;
+  key |= uint64_t(texture ? texture->id & 0xFFFU : 0U) << 28;
+  push(object, material, geometry, key);
+}
 
-    shader->bind();
-    shader->uniform("u_Model", transform);
-    shader->uniform("u_View", context.camera->get_view_matrix());
-    shader->uniform("u_Projection", context.camera->get_projection_matrix());
+void RenderQueue::push(Object3D* object, Material* material, Geometry* geometry, uint64_t key)
+{
+  // quarter meters, the overlay is drawn back to front
+  constexpr uint64_t max_depth = (1U << 28) - 1;
+  float distance = glm::length(object->get_world_position() - camera_pos);
+  uint64_t depth = std::min(static_cast<uint64_t>(std::max(distance, 0.0f) * 4.0f), max_depth);
+  if ((key >> 60) == OVERLAY) depth = max_depth - depth;
+
+  keys.push_back({key | depth, static_cast<uint32_t>(packets.size())});
+  packets.push_back({object, material, geometry});
+}
 
-    if (context.shadow_caster) {
-      shader->uniform("u_LightSpaceMatrix", context.shadow_caster->light_space_matrix());
+void RenderQueue::sort()
+{
+  scratch.resize(keys.size());
+  for (int shift = 0; shift < 64; shift += 8) {
+    std::array<uint32_t, 256> counts{};
+    for (const auto& key : keys) counts[(key.first >> shift) & 0xFF]++;
+    if (keys.empty() || counts[(keys[0].first >> shift) & 0xFF] == keys.size()) continue;
+
+    uint32_t offset = 0;
+    for (auto& count : counts) {
+      uint32_t n = count;
+      count = offset;
+      offset += n;
     }
+    for (const auto& key : keys) scratch[counts[(key.first >> shift) & 0xFF]++] = key;
+    keys.swap(scratch);
+  }
+}
+
+void RenderQueue::submit(RenderContext& context, RenderStats& stats)
+{
+  sort();
 
-    shader->uniform("u_BackgroundColor", context.background_color);
-    shader->uniform("u_NumLights", static_cast<int>(context.lights.size()));
-    shader->uniform("u_CameraPosition", context.camera->get_world_position());
-    shader->uniform("u_ReceiveShadow", (receive_shadow && context.shadow_caster));
+  gl::Shader* shader = nullptr;
+  Material* material = nullptr;
+  Geometry* geometry = nullptr;
 
-    for (int i = 0; i < context.lights.size(); i++) {
-      auto index = std::to_string(i);
-      auto type = context.lights[i]->type;
+  for (const auto& [key, index] : keys) {
+    const auto& packet = packets[index];
+    stats.packets++;
 
-      shader->uniform("u_Lights[" + index + "].type", type);
-      shader->uniform("u_Lights[" + index + "].color", context.lights[i]->rgb);
-      shader->uniform("u_Lights[" + index + "].position", context.lights[i]->get_world_position());
+    if (packet.material == nullptr) {
+      packet.object->draw_self(context);
+      shader = nullptr, material = nullptr, geometry = nullptr;
+      continue;
     }
 
-    context.shadow_map->depth_map.bind(0);
-    shader->uniform("u_ShadowMap", 0);
+    gl::Shader* next = context.is_shadow_pass ? &context.shadow_map->shader : packet.material->get_shader();
+    if (next != shader) {
+      shader = next, material = nullptr;
+      shader->bind();
+      stats.shader_binds++;
+
+      // the same for all draws with the shader
+      if (context.shadow_caster) shader->uniform("u_LightSpaceMatrix", context.shadow_caster->light_space_matrix());
+      if (!context.is_shadow_pass) {
+        shader->uniform("u_BackgroundColor", context.background_color);
+        context.shadow_map->depth_map.bind(0);
+        shader->uniform("u_ShadowMap", 0);
+      }
+    } else {
+      stats.binds_saved++;
+    }
 
-    m_material->bind();
-  }
+    shader->uniform("u_Model", packet.object->transform);
 
-  m_geometry->bind();
+    if (!context.is_shadow_pass) {
+      shader->uniform("u_ReceiveShadow", (packet.object->receive_shadow && context.shadow_caster));
+      if (packet.material != material) {
+        material = packet.material;
+        material->bind();
+        stats.material_binds++;
+      } else {
+        stats.binds_saved++;
+      }
+    }
+
+    if (packet.geometry != geometry) {
+      geometry = packet.geometry;
+      geometry->bind();
+      stats.geometry_binds++;
+    } else {
+      stats.binds_saved++;
+    }
+
+    glDrawArrays(GL_TRIANGLES, 0, geometry->triangle_count);
+  }
 
-  glDrawArrays(GL_TRIANGLES, 0, m_geometry->triangle_count);
-  m_geometry->unbind();
+  if (geometry) geometry->unbind();
+  if (shader) shader->unbind();
+}
 
-  draw_children(context);
+void Mesh::enqueue(RenderQueue& queue, const RenderContext& context)
+{
+  queue.add(this, m_material.get(), m_geometry.get());
 }
 
 ShadowMap::ShadowMap(unsigned int shadow_width, unsigned int shadow_height)
@@ -671,24 +885,26 @@ void OrbitController::move_mouse(float x, float y)
   m_pitch = glm::clamp(m_pitch, -89.0f, 89.0f);
 }
 
-void Phong::bind()
+void Phong::bind() { bind(*get_shader()); }
+
+void Phong::bind(gl::Shader& target)
 {
+  target.bind();
+
   if (texture != nullptr) {
     int texture_unit = 1;
     texture->bind(texture_unit);
-    shader->uniform("u_UseTexture", true);
-    shader->uniform("u_Texture1", texture_unit);
+    target.uniform("u_UseTexture", true);
+    target.uniform("u_Texture1", texture_unit);
   } else {
-    shader->uniform("u_UseTexture", false);
-    shader->uniform("u_SolidObjectColor", rgb);
+    target.uniform("u_UseTexture", false);
+    target.uniform("u_SolidObjectColor", rgb);
   }
 
-  gl::Shader* shader = get_shader();
-  shader->bind();
-  shader->uniform("ka", ka);
-  shader->uniform("kd", kd);
-  shader->uniform("ks", ks);
-  shader->uniform("alpha", alpha);
+  target.uniform("ka", ka);
+  target.uniform("kd", kd);
+  target.uniform("ks", ks);
+  target.uniform("alpha", alpha);
 }
 
 void Basic::bind()
@@ -911,6 +1127,68 @@ Billboard::Billboard(std::shared_ptr<gl::Texture> sprite, glm::vec3 color)
   vao.unbind();
 }
 
+std::shared_ptr<gl::Shader> InstancedMesh::shader = nullptr;
+
+InstancedMesh::InstancedMesh(std::shared_ptr<Geometry> geometry, std::shared_ptr<Phong> material)
+    : m_geometry(geometry), m_material(material)
+{
+  if (shader == nullptr) {
+    auto vertex = load_text_file("shaders/instanced.vert"), fragment = load_text_file("shaders/phong.frag");
+    shader = std::make_shared<gl::Shader>(vertex, fragment);
+  }
+
+  vao.bind();
+  m_geometry->set_attributes();
+
+  // the model matrix takes the locations 3 to 6, one per column, and the color 7
+  buffer.bind();
+  for (GLuint i = 0; i < 4; i++) {
+    glVertexAttribPointer(3 + i, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)(i * sizeof(glm::vec4)));
+    glEnableVertexAttribArray(3 + i);
+    glVertexAttribDivisor(3 + i, 1);
+  }
+  glVertexAttribPointer(7, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)offsetof(Instance, color));
+  glEnableVertexAttribArray(7);
+  glVertexAttribDivisor(7, 1);
+
+  vao.unbind();
+}
+
+void InstancedMesh::add(const glm::vec3& position, const glm::quat& rotation, const glm::vec3& color)
+{
+  instances.push_back({glm::translate(glm::mat4(1.0f), position) * glm::toMat4(rotation), glm::vec4(color, 1.0f)});
+}
+
+void InstancedMesh::enqueue(RenderQueue& queue, const RenderContext& context)
+{
+  if (!context.is_shadow_pass) queue.add(this, RenderQueue::SCENE);
+}
+
+void InstancedMesh::draw_self(RenderContext& context)
+{
+  if (context.is_shadow_pass || instances.empty()) return;
+
+  buffer.buffer(instances.data(), instances.size() * sizeof(instances[0]), GL_STREAM_DRAW);
+
+  m_material->bind(*shader);
+  shader->uniform("u_BackgroundColor", context.background_color);
+  shader->uniform("u_ReceiveShadow", (receive_shadow && context.shadow_caster));
+  if (context.shadow_caster) shader->uniform("u_LightSpaceMatrix", context.shadow_caster->light_space_matrix());
+
+  context.shadow_map->depth_map.bind(0);
+  shader->uniform("u_ShadowMap", 0);
+
+  vao.bind();
+  glDrawArraysInstanced(GL_TRIANGLES, 0, m_geometry->triangle_count, static_cast<GLsizei>(instances.size()));
+  vao.unbind();
+  shader->unbind();
+}
+
+void Billboard::enqueue(RenderQueue& queue, const RenderContext& context)
+{
+  if (!context.is_shadow_pass) queue.add(this, RenderQueue::OVERLAY);
+}
+
 void Billboard::draw_self(RenderContext& context)
 {
   if (context.is_shadow_pass) return;
@@ -922,8 +1200,6 @@ void Billboard::draw_self(RenderContext& context)
   glm::vec3 right = {view[0][0], view[1][0], view[2][0]};
 
   shader.bind();
-  shader.uniform("u_View", view);
-  shader.uniform("u_Projection", camera->get_projection_matrix());
   shader.uniform("u_Texture", 5);
   shader.uniform("u_Color", color);
   shader.uniform("u_Position", get_world_position());
@@ -952,6 +1228,11 @@ Skybox::Skybox(const std::array<std::string, 6>& faces)
 {
 }
 
+void Skybox::enqueue(RenderQueue& queue, const RenderContext& context)
+{
+  if (!context.is_shadow_pass) queue.add(this, RenderQueue::BACKGROUND);
+}
+
 void Skybox::draw_self(RenderContext& context)
 {
   if (!context.is_shadow_pass) {
@@ -2,7 +2,9 @@
 
 #include <GL/glew.h>
 
+#include <algorithm>
 #include <array>
+#include <cstddef>
 #include <fstream>
 #include <functional>
 #include <glm/glm.hpp>
@@ -11,9 +13,13 @@
 #include <memory>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
+// contents of a file, empty if it can not be opened
+std::string load_text_file(const std::string& path);
+
 namespace gfx
 {
 
@@ -28,6 +34,8 @@ class Camera;
 class Skybox;
 class Material;
 class Geometry;
+class Object3D;
+class RenderQueue;
 
 constexpr RGB rgb(int r, int g, int b)
 {
@@ -49,20 +57,59 @@ std::shared_ptr<Geometry> make_plane_geometry(int x_elements, int y_elements, fl
 namespace gl
 {
 
+// binding points of the uniform blocks shared by all shaders, the layouts are CameraBlock and LightsBlock
+enum UniformBlock : GLuint {
+  CAMERA_BLOCK = 0,  // "Camera"
+  LIGHTS_BLOCK = 1,  // "Lights"
+};
+
+// the locations of the active uniforms are looked up once after linking and found by the hash of their name, so
+// setting a uniform neither allocates nor asks the driver. elements of arrays are found as "name[i]", the first one
+// also as "name"
 struct Shader {
   GLuint id;
   Shader(const std::string& path);
   Shader(const std::string& vertShader, const std::string& fragShader);
-  Shader(GLuint shader_id) : id(shader_id) {}
+  Shader(GLuint shader_id) : id(shader_id) { reflect(); }
   ~Shader();
   void bind() const;
   void unbind() const;
-  void uniform(const std::string& name, int value);
-  void uniform(const std::string& name, float value);
-  void uniform(const std::string& name, unsigned int value);
-  void uniform(const std::string& name, const glm::vec3& value);
-  void uniform(const std::string& name, const glm::vec4& value);
-  void uniform(const std::string& name, const glm::mat4& value);
+  void uniform(std::string_view name, int value);
+  void uniform(std::string_view name, float value);
+  void uniform(std::string_view name, unsigned int value);
+  void uniform(std::string_view name, const glm::vec2& value);
+  void uniform(std::string_view name, const glm::vec3& value);
+  void uniform(std::string_view name, const glm::vec4& value);
+  void uniform(std::string_view name, const glm::mat4& value);
+  void uniform(std::string_view name, const glm::vec2* values, int count);
+
+  // -1 if the shader has no such active uniform
+  GLint location(std::string_view name) const
+  {
+    auto it = locations.find(hash(name));
+    return (it != locations.end()) ? it->second : -1;
+  }
+
+  // fnv-1a
+  static constexpr uint32_t hash(std::string_view name)
+  {
+    uint32_t h = 2166136261U;
+    for (char c : name) h = (h ^ static_cast<uint8_t>(c)) * 16777619U;
+    return h;
+  }
+
+ private:
+  std::unordered_map<uint32_t, GLint> locations;
+
+  void reflect();
+};
+
+// std140 buffer bound to one of the UniformBlock binding points
+struct UniformBuffer {
+  GLuint id = 0;
+  UniformBuffer(std::size_t size, GLuint binding);
+  ~UniformBuffer();
+  void update(const void* data, std::size_t size);
 };
 
 struct VertexBuffer {
@@ -71,7 +118,7 @@ struct VertexBuffer {
   ~VertexBuffer();
   void bind() const;
   void unbind() const;
-  void buffer(const void* data, size_t size);
+  void buffer(const void* data, size_t size, GLenum usage = GL_STATIC_DRAW);
 
   template <typename T>
   void buffer(const std::vector<T>& data)
@@ -123,7 +170,24 @@ struct Texture {
   GLint get_format(int channels);
   void set_parameteri(GLenum target, GLenum pname, GLint param);
 
+  // replaces the image, e.g. with one decoded on another thread
+  void upload(const unsigned char* data, int width, int height, int channels, const TextureParams& params = {});
+
   static unsigned char* load_image(const std::string path, int* width, int* height, int* channels, bool flip);
+  static void free_image(unsigned char* data);
+};
+
+// layers of equal size, e.g. the levels of the terrain clipmap
+struct TextureArray : public Texture {
+  GLenum format, type;
+
+  TextureArray(int width, int height, int layers, GLint internal_format, GLenum format, GLenum type,
+               const TextureParams& params = {});
+  void bind(GLuint texture) const override;
+  void unbind() const override;
+
+  // replaces a rectangle of a layer, the rows of data are row_length pixels apart
+  void update(int layer, int x, int y, int width, int height, const void* data, int row_length);
 };
 
 struct CubemapTexture : public Texture {
@@ -141,6 +205,33 @@ struct ShadowMap {
   GLuint width, height;
 };
 
+// std140 layout of the "Camera" block, updated once per frame
+struct CameraBlock {
+  glm::mat4 view;
+  glm::mat4 projection;
+  glm::vec4 position;  // w is unused
+};
+
+constexpr int MAX_LIGHTS = 4;  // same as in the shaders
+
+// std140 layout of the "Lights" block, updated once per frame
+struct LightsBlock {
+  struct Light {
+    int32_t type;
+    int32_t padding[3];
+    glm::vec3 color;
+    float padding1;
+    glm::vec3 position;
+    float padding2;
+  };
+
+  int32_t count;
+  int32_t padding[3];
+  Light lights[MAX_LIGHTS];
+};
+
+static_assert(sizeof(CameraBlock) == 144 && sizeof(LightsBlock) == 16 + 48 * MAX_LIGHTS, "std140 layouts");
+
 struct RenderContext {
   Camera* camera;
   Light* shadow_caster;
@@ -151,12 +242,65 @@ struct RenderContext {
   glm::vec3 background_color;
 };
 
+// binds and draws of the last frame, the binds are counted by the render queue
+struct RenderStats {
+  int packets = 0;
+  int shader_binds = 0;
+  int material_binds = 0;
+  int geometry_binds = 0;
+  int binds_saved = 0;  // binds skipped because the state was already set
+};
+
+// the draws of one pass, sorted by a 64 bit key of pass, shader, material, texture and depth, so that draws sharing
+// state follow each other and the binds between them are skipped. objects that draw themselves, like the terrain, are
+// drawn when the queue reaches them, after which all state is bound again
+class RenderQueue
+{
+ public:
+  enum Pass : uint8_t {
+    BACKGROUND,  // the skybox
+    SCENE,       // opaque, front to back
+    OVERLAY,     // blended, back to front
+  };
+
+  struct Packet {
+    Object3D* object;
+    Material* material;  // nullptr if the object draws itself
+    Geometry* geometry;
+  };
+
+  // starts a pass, the depth of the draws is their distance from the camera
+  void begin(const glm::vec3& camera_pos);
+
+  // an object that draws itself in draw_self()
+  void add(Object3D* object, Pass pass);
+
+  // a mesh with the standard uniforms
+  void add(Object3D* object, Material* material, Geometry* geometry);
+
+  void submit(RenderContext& context, RenderStats& stats);
+
+  std::size_t size() const { return packets.size(); }
+
+ private:
+  glm::vec3 camera_pos = glm::vec3(0.0f);
+  std::vector<Packet> packets;
+  std::vector<std::pair<uint64_t, uint32_t>> keys, scratch;  // key and packet index
+
+  void push(Object3D* object, Material* material, Geometry* geometry, uint64_t key);
+
+  // least significant digit first, 8 bits per digit, digits that are the same in all keys are skipped
+  void sort();
+};
+
 #define OBJ3D_TRANSFORM 1U << 0U
 #define OBJ3D_ROTATE    1U << 1U
 #define OBJ3D_SCALE     1U << 2U
 
 class Object3D
 {
+  friend class SceneGraph;
+
  public:
   enum Type { OBJECT3D, LIGHT, CAMERA };
 
@@ -167,6 +311,7 @@ class Object3D
 
   const int id;
   static int counter;
+  static unsigned hierarchy;  // changes whenever an object is added, the scene graphs are rebuilt then
   // which transform to inherit from parent
   unsigned transform_flags = OBJ3D_TRANSFORM | OBJ3D_ROTATE | OBJ3D_SCALE;
 
@@ -178,10 +323,11 @@ class Object3D
 
   Object3D& add(Object3D* child);
 
-  void draw(RenderContext& context);
-  void draw_children(RenderContext& context);
   virtual void draw_self(RenderContext& context);
 
+  // adds the draws of the object, not of its children, to the queue. nothing by default
+  virtual void enqueue(RenderQueue&, const RenderContext&) {}
+
   void set_scale(const glm::vec3& scale);
   void set_rotation(const glm::vec3& rotation);
   void rotate_by(const glm::vec3& rotation);
@@ -200,9 +346,7 @@ class Object3D
   virtual Object3D::Type get_type() const;
 
   void override_transform(const glm::mat4& matrix);
-  void update_world_matrix(bool dirty_parent);
   glm::mat4 get_local_transform() const;
-  glm::mat4 get_parent_transform() const;
   void traverse(const std::function<bool(Object3D*)>& func);
 
  protected:
@@ -270,7 +414,11 @@ class Geometry
   void unbind();
   int triangle_count;
 
+  // points the attributes of the bound vertex array object at the vertices, so that other vaos can share them
+  void set_attributes();
+
  private:
+  VertexLayout m_layout;
   unsigned int m_vao, m_vbo;
   gl::VertexBuffer vbo;
   gl::VertexArrayObject vao;
@@ -280,7 +428,11 @@ class Geometry
 class Material
 {
  public:
+  const int id = counter++;  // orders the draws in the render queue
+  static int counter;
+
   virtual gl::Shader* get_shader() { return nullptr; }
+  virtual const gl::Texture* get_texture() const { return nullptr; }
   virtual void bind() {}
 };
 
@@ -324,7 +476,11 @@ class Phong : public MaterialX<Phong>
   {
   }
 
+  const gl::Texture* get_texture() const override { return texture.get(); }
   void bind() override;
+
+  // sets the uniforms of another shader that uses phong.frag
+  void bind(gl::Shader& target);
 };
 
 class Basic : public MaterialX<Basic>
@@ -367,18 +523,48 @@ class Mesh : public Object3D
       : m_geometry(geometry), m_material(material)
   {
   }
-  void draw_self(RenderContext& context) override;
+  void enqueue(RenderQueue& queue, const RenderContext& context) override;
 
  protected:
   std::shared_ptr<Geometry> m_geometry;
   std::shared_ptr<Material> m_material;
 };
 
+// copies of one geometry, e.g. the aircraft of a fleet, drawn with a single instanced call. the instances are added
+// again every frame and their model matrices and colors are uploaded once before drawing. they do not cast shadows
+class InstancedMesh : public Object3D
+{
+ public:
+  InstancedMesh(std::shared_ptr<Geometry> geometry, std::shared_ptr<Phong> material);
+
+  void clear() { instances.clear(); }
+  void add(const glm::vec3& position, const glm::quat& rotation, const glm::vec3& color = glm::vec3(1.0f));
+  std::size_t size() const { return instances.size(); }
+
+  void draw_self(RenderContext& context) override;
+  void enqueue(RenderQueue& queue, const RenderContext& context) override;
+
+ private:
+  struct Instance {
+    glm::mat4 model;
+    glm::vec4 color;  // multiplies the color of the material, w is unused
+  };
+
+  std::shared_ptr<Geometry> m_geometry;
+  std::shared_ptr<Phong> m_material;
+  std::vector<Instance> instances;
+  gl::VertexArrayObject vao;
+  gl::VertexBuffer buffer;
+
+  static std::shared_ptr<gl::Shader> shader;
+};
+
 class Billboard : public Object3D
 {
  public:
   Billboard(std::shared_ptr<gl::Texture> sprite, glm::vec3 color = glm::vec3(1.0f));
   void draw_self(RenderContext& context) override;
+  void enqueue(RenderQueue& queue, const RenderContext& context) override;
   Object3D& add(Object3D* child) = delete;
 
  private:
@@ -395,9 +581,42 @@ class Skybox : public Mesh
  public:
   Skybox(const std::array<std::string, 6>& faces);
   void draw_self(RenderContext& context) override;
+  void enqueue(RenderQueue& queue, const RenderContext& context) override;
   Object3D& add(Object3D* child) = delete;
 };
 
+// the hierarchy under a root flattened into arrays with the parents before their children, so that the world matrices
+// are updated in one pass over the arrays instead of a recursion through the objects. the local transforms of the
+// objects are copied in when they changed and the world matrices that changed are copied back
+class SceneGraph
+{
+ public:
+  // rebuilds the arrays if objects were added since the last call or the root is another one
+  void build(Object3D& root);
+
+  // world matrices of the objects that moved or whose parents moved
+  void update();
+
+  const std::vector<Object3D*>& get_objects() const { return objects; }  // parents before their children
+  const std::vector<Light*>& get_lights() const { return lights; }
+  const std::vector<Camera*>& get_cameras() const { return cameras; }
+
+ private:
+  Object3D* root = nullptr;
+  unsigned version = 0;
+
+  std::vector<Object3D*> objects;
+  std::vector<int> parents;    // index of the parent, -1 for the root
+  std::vector<unsigned> flags;  // transform_flags
+  std::vector<glm::vec3> positions, scales;
+  std::vector<glm::quat> rotations, world_rotations;
+  std::vector<glm::mat4> world;
+  std::vector<uint8_t> dirty, overridden;  // overridden world matrices are kept for one frame
+
+  std::vector<Light*> lights;
+  std::vector<Camera*> cameras;
+};
+
 class Renderer
 {
  public:
@@ -428,10 +647,20 @@ class Renderer
   void render(Camera& camera, Object3D& scene);
   glm::vec3 background;
 
+  // of the last render()
+  const RenderStats& get_stats() const { return stats; }
+
  private:
   unsigned int m_width, m_height;
   ShadowMap* shadow_map = nullptr;
   std::shared_ptr<Mesh> screen_quad;
+  gl::UniformBuffer camera_block{sizeof(CameraBlock), gl::CAMERA_BLOCK};
+  gl::UniformBuffer lights_block{sizeof(LightsBlock), gl::LIGHTS_BLOCK};
+  SceneGraph graph;
+  RenderQueue queue;
+  RenderStats stats;
+
+  void draw(RenderContext& context);
 };
 
 class FirstPersonController
@@ -0,0 +1,200 @@
+/*
+    ground proximity warning for any number of aircraft
+*/
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <glm/glm.hpp>
+#include <limits>
+#include <vector>
+
+#include "collider.h"
+#include "phi.h"
+
+// every aircraft gets a few candidate trajectories extrapolated from its current velocity and turn rate. the
+// trajectories of all aircraft are split into segments and tested against the terrain in a single batch at a fixed
+// rate. an aircraft is alerted when its current trajectory hits the terrain, and the candidate that stays clear the
+// longest is offered as the escape
+class GroundProximity
+{
+ public:
+  enum Alert : uint8_t { NONE, CAUTION, WARNING };
+
+  // candidate trajectories, all start at the current position and keep the current speed
+  enum Trajectory : uint8_t {
+    CURRENT,  // current turn rate and flight path angle
+    PULL_UP,  // wings level, climbs to max_climb
+    LEFT,     // level turns at turn_bank
+    RIGHT,
+    TRAJECTORIES,
+  };
+
+  float rate = 10.0f;                     // checks per second
+  float lookahead = 30.0f;                // s
+  float caution_time = 30.0f;             // time to impact on the current trajectory that raises a caution, s
+  float warning_time = 12.0f;             // s
+  float clearance = 50.0f;                // height the trajectories must stay above the terrain, m
+  float pull_up_g = 3.0f;                 // load factor used to change the flight path angle
+  float max_climb = glm::radians(25.0f);  // flight path angle of the pull up
+  float turn_bank = glm::radians(60.0f);  // bank angle of the escape turns
+
+  // the terrain must outlive the warning system. it is anything with the batched raycast() of
+  // collider::HeightmapPyramid, e.g. the pyramid itself or the streamed Terrain
+  template <typename T>
+  GroundProximity(const T& terrain)
+      : raycast([&terrain](const auto& starts, const auto& ends, auto& t, float lift) {
+          terrain.raycast(starts, ends, t, lift);
+        })
+  {
+  }
+
+  // the rigid body must outlive the warning system
+  int add(const phi::RigidBody* rb)
+  {
+    bodies.push_back(rb);
+    results.push_back({});
+    return static_cast<int>(bodies.size() - 1);
+  }
+
+  std::size_t size() const { return bodies.size(); }
+
+  // runs a check once every 1 / rate seconds, returns true if one ran
+  bool update(phi::Seconds dt)
+  {
+    accumulator += dt;
+    if (accumulator < 1.0f / rate) return false;
+    accumulator = std::fmod(accumulator, 1.0f / rate);
+    check();
+    return true;
+  }
+
+  // extrapolate the trajectories of all aircraft and test them in one batch
+  void check()
+  {
+    const int segments_per_body = TRAJECTORIES * SEGMENTS;
+    from.resize(bodies.size() * segments_per_body);
+    to.resize(from.size());
+
+    for (std::size_t i = 0; i < bodies.size(); i++) {
+      for (int trajectory = 0; trajectory < TRAJECTORIES; trajectory++) {
+        std::size_t first = i * segments_per_body + trajectory * SEGMENTS;
+        extrapolate(*bodies[i], static_cast<Trajectory>(trajectory), &from[first], &to[first]);
+      }
+    }
+
+    raycast(from, to, hit, clearance);
+
+    const float segment_time = lookahead / SEGMENTS;
+
+    for (std::size_t i = 0; i < bodies.size(); i++) {
+      auto& result = results[i];
+
+      for (int trajectory = 0; trajectory < TRAJECTORIES; trajectory++) {
+        const float* t = &hit[i * segments_per_body + trajectory * SEGMENTS];
+        result.time_to_impact[trajectory] = std::numeric_limits<float>::infinity();
+        for (int segment = 0; segment < SEGMENTS; segment++) {
+          if (t[segment] >= 0.0f) {
+            result.time_to_impact[trajectory] = (segment + t[segment]) * segment_time;
+            break;
+          }
+        }
+      }
+
+      float time = result.time_to_impact[CURRENT];
+      result.alert = (time < warning_time) ? WARNING : (time < caution_time) ? CAUTION : NONE;
+
+      // pull up is preferred over turns and turns over doing nothing when they are equally good
+      result.escape = PULL_UP;
+      for (auto trajectory : {LEFT, RIGHT, CURRENT}) {
+        if (result.time_to_impact[trajectory] > result.time_to_impact[result.escape]) result.escape = trajectory;
+      }
+      result.escape_point = to[i * segments_per_body + result.escape * SEGMENTS];
+    }
+  }
+
+  Alert get_alert(int i) const { return results[i].alert; }
+
+  // seconds until the trajectory hits the terrain, infinity if it stays clear within the lookahead
+  float get_time_to_impact(int i, Trajectory trajectory = CURRENT) const
+  {
+    return results[i].time_to_impact[trajectory];
+  }
+
+  // the trajectory that stays clear of the terrain the longest
+  Trajectory get_escape(int i) const { return results[i].escape; }
+
+  // a point lookahead / SEGMENTS seconds along the escape trajectory, e.g. to steer towards with fly_towards()
+  const glm::vec3& get_escape_point(int i) const { return results[i].escape_point; }
+
+ private:
+  static constexpr int SEGMENTS = 6;  // segments per trajectory
+  static constexpr int SUBSTEPS = 4;  // integration steps per segment
+
+  struct Result {
+    Alert alert = NONE;
+    Trajectory escape = CURRENT;
+    float time_to_impact[TRAJECTORIES] = {};
+    glm::vec3 escape_point = glm::vec3(0.0f);
+  };
+
+  std::function<void(const std::vector<glm::vec3>&, const std::vector<glm::vec3>&, std::vector<float>&, float)> raycast;
+  std::vector<const phi::RigidBody*> bodies;
+  std::vector<Result> results;
+  std::vector<glm::vec3> from, to;  // segments of all trajectories of all aircraft
+  std::vector<float> hit;           // where each segment hits the terrain, -1 if it does not
+  float accumulator = 0.0f;
+
+  // writes the SEGMENTS segments of a trajectory to from and to
+  void extrapolate(const phi::RigidBody& rb, Trajectory trajectory, glm::vec3* from, glm::vec3* to) const
+  {
+    float speed = std::max(rb.get_speed(), 1.0f);
+    glm::vec2 direction = glm::vec2(rb.velocity.x, rb.velocity.z);
+    float horizontal_speed = glm::length(direction);
+    if (horizontal_speed > phi::EPSILON) {
+      direction /= horizontal_speed;
+    } else {
+      direction = glm::normalize(glm::vec2(rb.forward().x, rb.forward().z) + glm::vec2(phi::EPSILON, 0.0f));
+    }
+
+    float flight_path = std::atan2(rb.velocity.y, horizontal_speed);
+    float turn_rate = phi::EARTH_GRAVITY * std::tan(turn_bank) / speed;
+    float flight_path_rate = pull_up_g * phi::EARTH_GRAVITY / speed;
+
+    // heading rate is positive to the right, which is a negative rotation around the world up axis
+    float heading_rate = 0.0f, target_flight_path = 0.0f;
+    switch (trajectory) {
+      case CURRENT:
+        heading_rate = -rb.transform_direction(rb.angular_velocity).y;
+        target_flight_path = flight_path;
+        break;
+      case PULL_UP:
+        target_flight_path = std::max(flight_path, max_climb);
+        break;
+      case LEFT:
+        heading_rate = -turn_rate;
+        break;
+      case RIGHT:
+        heading_rate = turn_rate;
+        break;
+      default:
+        break;
+    }
+
+    const float dt = lookahead / (SEGMENTS * SUBSTEPS);
+    const float c = std::cos(heading_rate * dt), s = std::sin(heading_rate * dt);
+    glm::vec3 position = rb.position;
+
+    for (int segment = 0; segment < SEGMENTS; segment++) {
+      from[segment] = position;
+      for (int step = 0; step < SUBSTEPS; step++) {
+        direction = glm::vec2(direction.x * c - direction.y * s, direction.x * s + direction.y * c);
+        flight_path += glm::clamp(target_flight_path - flight_path, -flight_path_rate * dt, flight_path_rate * dt);
+        float horizontal = std::cos(flight_path) * speed * dt;
+        position += glm::vec3(direction.x * horizontal, std::sin(flight_path) * speed * dt, direction.y * horizontal);
+      }
+      to[segment] = position;
+    }
+  }
+};
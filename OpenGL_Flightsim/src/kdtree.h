@@ -0,0 +1,244 @@
+/*
+    k-d tree for proximity queries between many moving objects, rebuilt every step
+*/
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include <limits>
+#include <vector>
+
+#include "phi.h"
+
+namespace collider
+{
+
+class KDTree
+{
+ public:
+  static constexpr int MAX_NEIGHBORS = 64;  // upper bound for k in nearest()
+  static constexpr int LEAF_SIZE = 8;       // ranges smaller than this are searched linearly
+
+  // rebuild from a list of points, indices returned by queries refer to this list
+  void build(const std::vector<glm::vec3>& points)
+  {
+    m_points = points;
+    m_order.resize(points.size());
+    m_axis.resize(points.size());
+    for (std::size_t i = 0; i < m_order.size(); i++) m_order[i] = static_cast<int>(i);
+    build(0, static_cast<int>(m_order.size()));
+  }
+
+  // rebuild from the position of rigid bodies
+  template <typename RB>
+  void build(const std::vector<RB>& bodies)
+  {
+    m_scratch.resize(bodies.size());
+    for (std::size_t i = 0; i < bodies.size(); i++) m_scratch[i] = bodies[i].position;
+    build(m_scratch);
+  }
+
+  std::size_t size() const { return m_points.size(); }
+
+  const glm::vec3& point(int index) const { return m_points[index]; }
+
+  // find the k nearest points, sorted by distance. returns the number of points found
+  int nearest(const glm::vec3& point, int k, int* result, float* distances = nullptr, int exclude = -1) const
+  {
+    assert(0 < k && k <= MAX_NEIGHBORS);
+    Heap heap{.index = result, .capacity = k};
+    nearest(0, static_cast<int>(m_order.size()), point, exclude, heap);
+
+    // heap sort, leaves the closest point first
+    for (int n = heap.count; n > 1; n--) {
+      std::swap(heap.index[0], heap.index[n - 1]);
+      std::swap(heap.distance[0], heap.distance[n - 1]);
+      heap.sift_down(0, n - 1);
+    }
+
+    if (distances != nullptr) {
+      for (int i = 0; i < heap.count; i++) distances[i] = std::sqrt(heap.distance[i]);
+    }
+
+    return heap.count;
+  }
+
+  // append all points within radius to result
+  void within_radius(const glm::vec3& point, float radius, std::vector<int>& result, int exclude = -1) const
+  {
+    within_radius(0, static_cast<int>(m_order.size()), point, phi::sq(radius), exclude, result);
+  }
+
+  // append all points inside a cone to result, e.g. a sensor looking along RigidBody::forward()
+  void within_cone(const glm::vec3& origin, const glm::vec3& direction, float half_angle, float range,
+                   std::vector<int>& result, int exclude = -1) const
+  {
+    std::size_t first = result.size();
+    within_radius(origin, range, result, exclude);
+
+    // direction need not be normalized, half_angle may be wider than 90 degrees
+    const glm::vec3 axis = glm::normalize(direction);
+    const float cos_angle = std::cos(half_angle);
+    auto outside = [&](int i) {
+      auto offset = m_points[i] - origin;
+      return glm::dot(offset, axis) < cos_angle * glm::length(offset);
+    };
+
+    result.erase(std::remove_if(result.begin() + first, result.end(), outside), result.end());
+  }
+
+  // batched k nearest neighbors, result holds k indices per query and is padded with -1.
+  // if exclude_self is set, query i does not return point i
+  void nearest(const std::vector<glm::vec3>& points, int k, std::vector<int>& result, bool exclude_self = false) const
+  {
+    result.assign(points.size() * k, -1);
+    for (std::size_t i = 0; i < points.size(); i++) {
+      nearest(points[i], k, &result[i * k], nullptr, exclude_self ? static_cast<int>(i) : -1);
+    }
+  }
+
+  // batched radius query, the points found for query i are result[offsets[i]] to result[offsets[i + 1]]
+  void within_radius(const std::vector<glm::vec3>& points, float radius, std::vector<int>& offsets,
+                     std::vector<int>& result, bool exclude_self = false) const
+  {
+    offsets.resize(points.size() + 1);
+    result.clear();
+    for (std::size_t i = 0; i < points.size(); i++) {
+      offsets[i] = static_cast<int>(result.size());
+      within_radius(points[i], radius, result, exclude_self ? static_cast<int>(i) : -1);
+    }
+    offsets.back() = static_cast<int>(result.size());
+  }
+
+  // batched cone query, same output layout as the batched radius query
+  void within_cone(const std::vector<glm::vec3>& origins, const std::vector<glm::vec3>& directions,
+                   float half_angle, float range, std::vector<int>& offsets, std::vector<int>& result,
+                   bool exclude_self = false) const
+  {
+    assert(origins.size() == directions.size());
+    offsets.resize(origins.size() + 1);
+    result.clear();
+    for (std::size_t i = 0; i < origins.size(); i++) {
+      offsets[i] = static_cast<int>(result.size());
+      within_cone(origins[i], directions[i], half_angle, range, result, exclude_self ? static_cast<int>(i) : -1);
+    }
+    offsets.back() = static_cast<int>(result.size());
+  }
+
+ private:
+  std::vector<glm::vec3> m_points;
+  std::vector<glm::vec3> m_scratch;
+  std::vector<int> m_order;     // point indices, in tree order
+  std::vector<uint8_t> m_axis;  // split axis of the node at this position in m_order
+
+  // max heap of the best candidates, the worst candidate is on top
+  struct Heap {
+    int* index;
+    int capacity;
+    int count = 0;
+    std::array<float, MAX_NEIGHBORS> distance{};
+
+    float worst() const { return count < capacity ? std::numeric_limits<float>::max() : distance[0]; }
+
+    void sift_down(int i, int n)
+    {
+      for (int child; (child = 2 * i + 1) < n; i = child) {
+        if (child + 1 < n && distance[child + 1] > distance[child]) child++;
+        if (distance[child] <= distance[i]) break;
+        std::swap(distance[i], distance[child]);
+        std::swap(index[i], index[child]);
+      }
+    }
+
+    void push(int i, float d)
+    {
+      if (count < capacity) {
+        int n = count++;
+        index[n] = i, distance[n] = d;
+        for (int parent; n > 0 && distance[parent = (n - 1) / 2] < distance[n]; n = parent) {
+          std::swap(distance[n], distance[parent]);
+          std::swap(index[n], index[parent]);
+        }
+      } else if (d < distance[0]) {
+        index[0] = i, distance[0] = d;
+        sift_down(0, count);
+      }
+    }
+  };
+
+  void build(int begin, int end)
+  {
+    if (end - begin <= LEAF_SIZE) return;
+
+    // split along the axis with the largest extent
+    glm::vec3 min(std::numeric_limits<float>::max()), max(std::numeric_limits<float>::lowest());
+    for (int i = begin; i < end; i++) {
+      min = glm::min(min, m_points[m_order[i]]);
+      max = glm::max(max, m_points[m_order[i]]);
+    }
+
+    auto extent = max - min;
+    int axis = (extent.x > extent.y) ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+
+    int mid = (begin + end) / 2;
+    std::nth_element(m_order.begin() + begin, m_order.begin() + mid, m_order.begin() + end,
+                     [this, axis](int a, int b) { return m_points[a][axis] < m_points[b][axis]; });
+    m_axis[mid] = static_cast<uint8_t>(axis);
+
+    build(begin, mid);
+    build(mid + 1, end);
+  }
+
+  void nearest(int begin, int end, const glm::vec3& point, int exclude, Heap& heap) const
+  {
+    if (end - begin <= LEAF_SIZE) {
+      for (int i = begin; i < end; i++) {
+        int index = m_order[i];
+        float d = glm::dot(m_points[index] - point, m_points[index] - point);
+        if (index != exclude && d < heap.worst()) heap.push(index, d);
+      }
+      return;
+    }
+
+    int mid = (begin + end) / 2, index = m_order[mid];
+    int axis = m_axis[mid];
+    float d = glm::dot(m_points[index] - point, m_points[index] - point);
+    if (index != exclude && d < heap.worst()) heap.push(index, d);
+
+    float delta = point[axis] - m_points[index][axis];
+    bool left_first = delta < 0.0f;
+
+    nearest(left_first ? begin : mid + 1, left_first ? mid : end, point, exclude, heap);
+    if (phi::sq(delta) < heap.worst()) {
+      nearest(left_first ? mid + 1 : begin, left_first ? end : mid, point, exclude, heap);
+    }
+  }
+
+  void within_radius(int begin, int end, const glm::vec3& point, float radius_sq, int exclude,
+                     std::vector<int>& result) const
+  {
+    if (end - begin <= LEAF_SIZE) {
+      for (int i = begin; i < end; i++) {
+        int index = m_order[i];
+        float d = glm::dot(m_points[index] - point, m_points[index] - point);
+        if (index != exclude && d <= radius_sq) result.push_back(index);
+      }
+      return;
+    }
+
+    int mid = (begin + end) / 2, index = m_order[mid];
+    int axis = m_axis[mid];
+    float d = glm::dot(m_points[index] - point, m_points[index] - point);
+    if (index != exclude && d <= radius_sq) result.push_back(index);
+
+    float delta = point[axis] - m_points[index][axis];
+    if (delta <= 0.0f || phi::sq(delta) <= radius_sq) within_radius(begin, mid, point, radius_sq, exclude, result);
+    if (delta >= 0.0f || phi::sq(delta) <= radius_sq) within_radius(mid + 1, end, point, radius_sq, exclude, result);
+  }
+};
+
+};  // namespace collider
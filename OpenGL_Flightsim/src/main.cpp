@@ -6,6 +6,7 @@
 #include <cstdio>
 #include <fstream>
 #include <iostream>
+#include <random>
 #include <sstream>
 #include <vector>
 
@@ -13,9 +14,12 @@
 #include "../lib/imgui/imgui_impl_opengl3.h"
 #include "../lib/imgui/imgui_impl_sdl2.h"
 #include "ai.h"
+#include "autopilot.h"
 #include "collider.h"
 #include "flightmodel.h"
 #include "gfx.h"
+#include "gpws.h"
+#include "kdtree.h"
 #include "phi.h"
 #include "pid.h"
 #include "terrain.h"
@@ -31,19 +35,24 @@ Usage:
 P       pause game
 O       toggle camera
 I       toggle wireframe terrain
+H       toggle autopilot, holds the current altitude, heading and speed
 WASD    control pitch and roll
 EQ      control yaw
 JK      control thrust
 )";
 
 #define CLIPMAP            1
+#define CDLOD              0  // needs CLIPMAP, draws the terrain with the cdlod quadtree instead of the rings
 #define SKYBOX             1
 #define SMOOTH_CAMERA      1
 #define NPC_AIRCRAFT       0
+#define NPC_COUNT          16
+#define TRAFFIC_COUNT      0  // aircraft circling around the start, to benchmark instancing with e.g. 1000 or 10000
 #define SHOW_MASS_ELEMENTS 0
 #define USE_PID            1
 #define PS1_RESOLUTION     1
 #define DEBUG_INFO         0
+#define GPWS               1  // needs CLIPMAP
 
 /* select flightmodel */
 #define FAST_JET    0
@@ -122,7 +131,8 @@ int main(void)
   Joystick joystick;
 
   // use pid for keyboard control
-  PID pitch_control_pid(1.0f, 0.0f, 0.0f);
+  PIDBank flight_control(120.0f);
+  int pitch_rate_pid = flight_control.add(1.0f, 0.0f, 0.0f);
 
   int num_joysticks = SDL_NumJoysticks();
   bool joystick_control = num_joysticks > 0;
@@ -166,14 +176,29 @@ int main(void)
 #endif
 
 #if CLIPMAP
-  Clipmap clipmap;
-  scene.add(&clipmap);
+  // tiles are decoded on the streaming threads and copied into the terrain textures once they are loaded
+  TerrainStreamer streamer(TERRAIN_ROOT, TERRAIN_ORIGIN, MAX_TILE_SIZE, TERRAIN_BASE_ZOOM,
+                           [](const std::string& path, Image& image) {
+                             uint8_t* pixels = gfx::gl::Texture::load_image(path, &image.width, &image.height,
+                                                                            &image.channels, false);
+                             if (!pixels) return false;
+                             image.pixels.assign(pixels, pixels + image.width * image.height * image.channels);
+                             gfx::gl::Texture::free_image(pixels);
+                             return true;
+                           });
+#if CDLOD
+  CdlodTerrain terrain(streamer);
+#else
+  Clipmap terrain(streamer);
 #endif
-#if 0
-  int width, height, channels;
-  const std::string heightmap_path = "assets/textures/terrain/1/heightmap.png";
-  uint8_t* data                    = gfx::gl::Texture::load_image(heightmap_path, &width, &height, &channels, 0);
-  phi::Heightmap terrain_collider(data, width, height, channels);
+  scene.add(&terrain);
+
+  // for the batched terrain height queries
+  std::vector<glm::vec3> positions;
+  std::vector<float> terrain_heights;
+#endif
+#if GPWS
+  GroundProximity gpws(terrain);
 #endif
 
   std::vector<GameObject*> objects;
@@ -314,6 +339,12 @@ int main(void)
       Airplane(mass, inertia, wings, {engine}, nullptr),
   };
 
+#if NPC_AIRCRAFT
+  // game objects keep references into this vector, so it must not grow after this point
+  rigid_bodies.reserve(1 + NPC_COUNT);
+  for (int i = 0; i < NPC_COUNT; i++) rigid_bodies.push_back(rigid_bodies[0]);
+#endif
+
   GameObject player = {
       .transform = gfx::Mesh(model, texture),
       .airplane = rigid_bodies[0],
@@ -321,9 +352,19 @@ int main(void)
 
   player.airplane.position = initial_position;
   player.airplane.velocity = glm::vec3(speed, 0.0f, 0.0f);
+
+  Autopilot autopilot;
+  int player_autopilot = autopilot.add(&player.airplane);
+#if GPWS
+  int player_gpws = gpws.add(&player.airplane);
+#endif
   scene.add(&player.transform);
   objects.push_back(&player);
 
+  // all other aircraft are drawn with one instanced call
+  gfx::InstancedMesh aircraft(model, texture);
+  scene.add(&aircraft);
+
 #if SHOW_MASS_ELEMENTS
   auto red_texture = make_shared<gfx::Phong>(glm::vec3(1.0f, 0.0f, 0.0f));
 
@@ -337,21 +378,56 @@ int main(void)
 #endif
 
 #if NPC_AIRCRAFT
-  GameObject npc = {.transform = gfx::Mesh(model, texture),
-                    .airplane = Airplane(mass, inertia, wings, engine),
-                    .collider = collider::Sphere({0.0f, 0.0f, 0.0f}, 15.0f)};
-
-  npc.airplane.position = position - glm::vec3(-100.0f, 0.0f, 10.0f);
-  npc.airplane.velocity = glm::vec3(speed, 0.0f, 0.0f);
-  scene.add(&npc.transform);
-  objects.push_back(&npc);
+  FleetAI fleet;
+  AIScheduler scheduler;
+  collider::KDTree kdtree;
+  std::vector<int> in_sensor_cone;
+  std::vector<GameObject> npcs;
+  std::vector<shared_ptr<gfx::Billboard>> target_markers;
+  npcs.reserve(NPC_COUNT);
 
   auto red = glm::vec3(1.0f, 0.0f, 0.0f);
-  gfx::Billboard target_marker(make_shared<gfx::gl::Texture>("assets/textures/sprites/triangle.png"), red);
-  target_marker.set_scale(glm::vec3(0.05f));
-  target_marker.set_position({0.0f, 10.0f, 0.0f});
-  target_marker.transform_flags = OBJ3D_TRANSFORM | OBJ3D_SCALE;
-  npc.transform.add(&target_marker);
+  auto triangle = make_shared<gfx::gl::Texture>("assets/textures/sprites/triangle.png");
+
+  for (int i = 0; i < NPC_COUNT; i++) {
+    auto& airplane = rigid_bodies[1 + i];
+    airplane.position = initial_position - glm::vec3(100.0f * (i + 1), 0.0f, 50.0f * (i % 4));
+    airplane.velocity = glm::vec3(speed, 0.0f, 0.0f);
+    fleet.add(&airplane, &player.airplane);
+    scheduler.add(scheduler.near_rate);
+#if GPWS
+    gpws.add(&airplane);  // 1 + i
+#endif
+
+    // drawn by the instanced mesh, the transform only carries the target marker
+    auto& npc = npcs.emplace_back(GameObject{.transform = gfx::Mesh(model, texture), .airplane = airplane});
+    npc.transform.visible = false;
+    scene.add(&npc.transform);
+    objects.push_back(&npc);
+
+    auto target_marker = make_shared<gfx::Billboard>(triangle, red);
+    target_marker->set_scale(glm::vec3(0.05f));
+    target_marker->set_position({0.0f, 10.0f, 0.0f});
+    target_marker->transform_flags = OBJ3D_TRANSFORM | OBJ3D_SCALE;
+    npc.transform.add(target_marker.get());
+    target_markers.push_back(target_marker);
+  }
+#endif
+
+#if TRAFFIC_COUNT
+  // level turns at random headings, heights and rates, without collisions
+  constexpr float traffic_speed = 150.0f;
+  std::vector<phi::RigidBody> traffic(TRAFFIC_COUNT);
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> random(-1.0f, 1.0f);
+
+  for (auto& rb : traffic) {
+    rb.apply_gravity = false;
+    rb.position = initial_position + glm::vec3(random(rng) * 5000.0f, random(rng) * 500.0f, random(rng) * 5000.0f);
+    rb.rotation = glm::angleAxis(random(rng) * glm::pi<float>(), phi::UP);
+    rb.velocity = rb.forward() * traffic_speed;
+    rb.angular_velocity = phi::UP * (random(rng) * 0.1f);  // rad/s
+  }
 #endif
 
 #if 1
@@ -431,9 +507,21 @@ int main(void)
               orbit = !orbit;
               break;
 
+            case SDLK_h:
+              if (autopilot.get_mode(player_autopilot) == Autopilot::OFF) {
+                autopilot.set_altitude(player_autopilot, player.airplane.position.y);
+                autopilot.set_heading(player_autopilot, Autopilot::get_heading(player.airplane));
+                autopilot.set_speed(player_autopilot, player.airplane.get_speed());
+                autopilot.set_mode(player_autopilot,
+                                   Autopilot::ALTITUDE_HOLD | Autopilot::HEADING_HOLD | Autopilot::SPEED_HOLD);
+              } else {
+                autopilot.set_mode(player_autopilot, Autopilot::OFF);
+              }
+              break;
+
             case SDLK_i:
 #if CLIPMAP
-              clipmap.wireframe = !clipmap.wireframe;
+              terrain.wireframe = !terrain.wireframe;
 #endif
               break;
 
@@ -503,7 +591,7 @@ int main(void)
     }
 
     ImGui::SetNextWindowPos(ImVec2(10, 10));
-    ImGui::SetNextWindowSize(ImVec2(145, 160));
+    ImGui::SetNextWindowSize(ImVec2(145, 160 + 20 * GPWS));
     ImGui::SetNextWindowBgAlpha(0.35f);
     ImGui::Begin("Flightsim", nullptr, window_flags);
     ImGui::Text("ALT:   %.1f m", alt);
@@ -514,13 +602,17 @@ int main(void)
     ImGui::Text("AoA:   %.2f", aoa);
     ImGui::Text("Trim:  %.2f", player.airplane.joystick.w);
     ImGui::Text("FPS:   %.1f", fps);
+#if GPWS
+    const char* alerts[] = {"", "TERRAIN", "PULL UP"};
+    ImGui::Text("GPWS:  %s", alerts[gpws.get_alert(player_gpws)]);
+#endif
     ImGui::End();
 
 #if DEBUG_INFO
     auto angular_velocity = glm::degrees(player.airplane.angular_velocity);
     auto attitude = glm::degrees(player.airplane.get_euler_angles());
 
-    ImVec2 size(140, 140);
+    ImVec2 size(140, 180 + 40 * CLIPMAP);
     ImGui::SetNextWindowPos(ImVec2(RESOLUTION.x - size.y - 10.0f, RESOLUTION.y - size.y - 10.0f));
     ImGui::SetNextWindowSize(size);
     ImGui::SetNextWindowBgAlpha(0.35f);
@@ -532,6 +624,12 @@ int main(void)
     ImGui::Text("Roll:       %.1f", attitude.x);
     ImGui::Text("Yaw:        %.1f", attitude.y);
     ImGui::Text("Pitch:      %.1f", attitude.z);
+    ImGui::Text("Draws:      %d", renderer.get_stats().packets);
+    ImGui::Text("Binds:      %d saved", renderer.get_stats().binds_saved);
+#if CLIPMAP
+    ImGui::Text("Terrain:    %d/%d", terrain.get_drawn(), terrain.get_drawn() + terrain.get_culled());
+    ImGui::Text("Meshes:     %zu KB", terrain.get_memory() / 1024);
+#endif
     ImGui::End();
 #endif
 
@@ -543,24 +641,92 @@ int main(void)
       float max_av = 45.0f;  // deg/s
       float target_av = max_av * joystick.elevator;
       float current_av = glm::degrees(player.airplane.angular_velocity.z);
-      player.airplane.joystick.z = pitch_control_pid.calculate(current_av, target_av, dt);
+      flight_control.set(pitch_rate_pid, current_av, target_av);
+      flight_control.update(dt);
+      player.airplane.joystick.z = flight_control.get(pitch_rate_pid);
     }
 #endif
     player.airplane.throttle = joystick.throttle;
 
+    // overrides the controls of the active autopilot modes
+    if (!paused) autopilot.update(dt);
+
+#if CLIPMAP
+    streamer.update(player.airplane.position, player.airplane.velocity);
+    terrain.update();
+#endif
+
+#if GPWS
+    if (!paused) gpws.update(dt);
+#endif
+
 #if NPC_AIRCRAFT
-    target_marker.visible = glm::length(camera.get_world_position() - npc.airplane.position) > 500.0f;
-    // fly_towards(npc.airplane, player.airplane.position);
+    // npcs in front of the player are in combat
+    kdtree.build(rigid_bodies);
+    in_sensor_cone.clear();
+    kdtree.within_cone(player.airplane.position, player.airplane.forward(), glm::radians(30.0f), 5000.0f,
+                       in_sensor_cone, 0);
+
+    for (int i = 0; i < NPC_COUNT; i++) {
+      target_markers[i]->visible = glm::length(camera.get_world_position() - npcs[i].airplane.position) > 500.0f;
+
+      float distance = glm::length(player.airplane.position - npcs[i].airplane.position);
+      bool in_combat = std::find(in_sensor_cone.begin(), in_sensor_cone.end(), 1 + i) != in_sensor_cone.end();
+      scheduler.set_rate(i, distance, in_combat);
+    }
+
+    fleet.gather();
+    scheduler.update(dt, [&fleet](int i, phi::Seconds) { fleet.update(i, i + 1); });
+    fleet.apply();
+
+#if GPWS
+    // npcs that are about to fly into the terrain break off and follow the escape trajectory
+    for (int i = 0; i < NPC_COUNT; i++) {
+      if (gpws.get_alert(1 + i) == GroundProximity::WARNING) {
+        fly_towards(npcs[i].airplane, gpws.get_escape_point(1 + i));
+      }
+    }
+#endif
 #endif
 
     if (!paused) {
       phi::step_physics(rigid_bodies, dt);
 
+#if CLIPMAP
+      // aircraft can not sink into the terrain, all heights are looked up in one batch
+      positions.clear();
+      for (const auto& rb : rigid_bodies) positions.push_back(rb.position);
+      terrain.get_heights(positions, terrain_heights);
+
+      for (std::size_t i = 0; i < rigid_bodies.size(); i++) {
+        auto& rb = rigid_bodies[i];
+        if (rb.position.y < terrain_heights[i]) {
+          rb.position.y = terrain_heights[i];
+          rb.velocity.y = std::max(rb.velocity.y, 0.0f);
+        }
+      }
+#endif
+
       for (auto obj : objects) {
         obj->update(dt);
       }
+
+#if TRAFFIC_COUNT
+      // the velocity turns with the heading
+      for (auto& rb : traffic) {
+        rb.add_force(glm::cross(phi::UP, rb.velocity) * rb.angular_velocity.y * rb.mass);
+        rb.update(dt);
+      }
+#endif
     }
 
+    // the instances are rebuilt from the state of the rigid bodies every frame
+    aircraft.clear();
+    for (auto it = rigid_bodies.begin() + 1; it != rigid_bodies.end(); ++it) aircraft.add(it->position, it->rotation);
+#if TRAFFIC_COUNT
+    for (const auto& rb : traffic) aircraft.add(rb.position, rb.rotation);
+#endif
+
     fpm.set_position(glm::normalize(player.airplane.get_body_velocity()) * projection_distance);
 
     if (orbit) {
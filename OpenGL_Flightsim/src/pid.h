@@ -1,6 +1,10 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+#include <glm/common.hpp>
 #include <glm/vec2.hpp>
+#include <vector>
 
 #define DEBUG_LOG 0
 
@@ -51,3 +55,120 @@ class PID
     return std::isnan(result) ? 0.0f : result;
   }
 };
+
+// many pid controllers stepped together at a fixed rate, independent of the frame rate. the controllers are
+// stored in blocks of LANES and each field of a block is a small array, so a block is updated field by field with
+// the state of neighbouring controllers next to each other. controllers that must run at different rates go into
+// separate banks
+class PIDBank
+{
+ public:
+  static constexpr int LANES = 8;
+
+  const float timestep;
+
+  PIDBank(float rate = 120.0f) : timestep(1.0f / rate) {}
+
+  // derivative_filter is the time constant of the low pass filter on the derivative term in seconds
+  int add(float kp, float ki, float kd, bool use_value = true, const glm::vec2& range = {-1.0f, 1.0f},
+          float derivative_filter = 0.0f)
+  {
+    int i = count++;
+    if (i % LANES == 0) blocks.push_back({});
+
+    auto& block = blocks[i / LANES];
+    int lane = i % LANES;
+    block.kp[lane] = kp, block.ki[lane] = ki, block.kd[lane] = kd;
+    block.derivative_on_value[lane] = use_value ? 1.0f : 0.0f;
+    block.filter[lane] = derivative_filter;
+    block.min[lane] = range.x, block.max[lane] = range.y;
+    block.enabled[lane] = 1.0f;
+    return i;
+  }
+
+  std::size_t size() const { return count; }
+
+  void set_gains(int i, float kp, float ki, float kd)
+  {
+    auto& block = blocks[i / LANES];
+    block.kp[i % LANES] = kp, block.ki[i % LANES] = ki, block.kd[i % LANES] = kd;
+  }
+
+  // a disabled controller outputs 0 and starts from a clean state when it is enabled again
+  void set_enabled(int i, bool enable) { blocks[i / LANES].enabled[i % LANES] = enable ? 1.0f : 0.0f; }
+
+  bool is_enabled(int i) const { return blocks[i / LANES].enabled[i % LANES] != 0.0f; }
+
+  void set(int i, float current_value, float target_value)
+  {
+    auto& block = blocks[i / LANES];
+    block.value[i % LANES] = current_value, block.target[i % LANES] = target_value;
+  }
+
+  float get(int i) const { return blocks[i / LANES].output[i % LANES]; }
+
+  // runs as many fixed steps as fit in dt and returns the number of steps, the outputs are held in between
+  int update(float dt, int max_steps = 8)
+  {
+    int steps = 0;
+    for (accumulator += dt; accumulator >= timestep && steps < max_steps; accumulator -= timestep) {
+      step();
+      steps++;
+    }
+    accumulator = std::min(accumulator, timestep);
+    return steps;
+  }
+
+  void step()
+  {
+    for (auto& block : blocks) step(block, timestep);
+  }
+
+ private:
+  // unused lanes of the last block are disabled and always output 0
+  struct Block {
+    float value[LANES]{}, target[LANES]{}, output[LANES]{};
+    float kp[LANES]{}, ki[LANES]{}, kd[LANES]{};
+    float derivative_on_value[LANES]{};  // 1 to differentiate the value instead of the error
+    float filter[LANES]{};
+    float min[LANES]{}, max[LANES]{};
+    float integral[LANES]{}, derivative[LANES]{}, previous[LANES]{};
+    float enabled[LANES]{}, initialized[LANES]{};  // masks, 0 or 1
+  };
+
+  int count = 0;
+  float accumulator = 0.0f;
+  std::vector<Block> blocks;
+
+  static void step(Block& b, float dt)
+  {
+    const float inverse_dt = 1.0f / dt;
+
+    for (int i = 0; i < LANES; i++) {
+      float error = b.target[i] - b.value[i];
+      float P = error * b.kp[i];
+
+      // derivative on the measurement avoids kicks when the target jumps
+      float signal = error + b.derivative_on_value[i] * (-b.value[i] - error);
+      float rate = (signal - b.previous[i]) * inverse_dt * b.initialized[i];
+      float alpha = dt / (b.filter[i] + dt);
+      float D = b.derivative[i] + alpha * (rate * b.kd[i] - b.derivative[i]);
+
+      // the integral is stored scaled by its gain, so changing ki does not cause a jump in the output
+      float I = glm::clamp(b.integral[i] + error * b.ki[i] * dt, b.min[i], b.max[i]);
+
+      float unclamped = P + I + D;
+      float result = glm::clamp(unclamped, b.min[i], b.max[i]);
+
+      // anti windup: stop integrating while the output is saturated and the error pushes it further out
+      bool windup = (unclamped - result) * error > 0.0f;
+      I = windup ? b.integral[i] : I;
+
+      b.integral[i] = I * b.enabled[i];
+      b.derivative[i] = D * b.enabled[i];
+      b.previous[i] = signal;
+      b.output[i] = result * b.enabled[i];
+      b.initialized[i] = b.enabled[i];
+    }
+  }
+};
@@ -0,0 +1,379 @@
+/*
+    terrain following route planner for ai aircraft
+*/
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <glm/glm.hpp>
+#include <limits>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "phi.h"
+
+// plans routes over a cost grid built from the terrain. cells whose terrain plus clearance is above the ceiling of a
+// request are blocked, the others cost more the steeper and higher they are. routes are searched with theta* on a
+// coarse grid first, the fine search is then restricted to the corridor around the coarse route. coarse routes are
+// cached, since many agents fly between the same areas
+class TerrainPlanner
+{
+ public:
+  static constexpr int COARSE = 4;  // fine cells per coarse cell along each axis
+
+  struct Params {
+    float clearance = 300.0f;      // minimum height above the terrain, m
+    float slope_weight = 2.0f;     // extra cost for steep cells
+    float altitude_weight = 1.0f;  // extra cost for high cells, prefers valleys
+  };
+
+  struct Request {
+    int agent;
+    glm::vec3 start, goal;
+    float ceiling;  // highest altitude the agent may fly at, m
+  };
+
+  struct Plan {
+    int agent;
+    bool found;
+    std::vector<glm::vec3> waypoints;  // excluding the start, the altitude clears the terrain along each leg
+  };
+
+  TerrainPlanner(int num_threads = 2)
+  {
+    for (int i = 0; i < num_threads; i++) workers.emplace_back([this]() { work(); });
+  }
+
+  ~TerrainPlanner()
+  {
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex);
+      stop = true;
+    }
+    queue_changed.notify_all();
+    for (auto& worker : workers) worker.join();
+  }
+
+  // build the cost grid for the square area around center, the terrain must provide get_height(glm::vec2).
+  // must not be called while plans are pending
+  template <typename Terrain>
+  void build(const Terrain& terrain, const glm::vec2& center, float extent, float cell_size, const Params& p = {})
+  {
+    params = p;
+    int size = static_cast<int>(std::ceil(2.0f * extent / (cell_size * COARSE))) * COARSE;
+    fine = Level(size, cell_size, center - glm::vec2(extent));
+    coarse = Level(size / COARSE, cell_size * COARSE, fine.origin);
+
+    // the highest and lowest of a few samples per cell
+    std::vector<float> lowest(fine.required.size());
+    float min_height = std::numeric_limits<float>::max(), max_height = std::numeric_limits<float>::lowest();
+
+    for (int y = 0; y < size; y++) {
+      for (int x = 0; x < size; x++) {
+        float high = std::numeric_limits<float>::lowest(), low = std::numeric_limits<float>::max();
+        for (int sy = 0; sy < 3; sy++) {
+          for (int sx = 0; sx < 3; sx++) {
+            auto point = fine.origin + (glm::vec2(x, y) + glm::vec2(sx, sy) * 0.5f) * cell_size;
+            float height = terrain.get_height(point);
+            high = std::max(high, height), low = std::min(low, height);
+          }
+        }
+        int i = y * size + x;
+        fine.required[i] = high, lowest[i] = low;
+        min_height = std::min(min_height, low), max_height = std::max(max_height, high);
+      }
+    }
+
+    float range = std::max(max_height - min_height, 1.0f);
+    for (std::size_t i = 0; i < fine.cost.size(); i++) {
+      float slope = (fine.required[i] - lowest[i]) / cell_size;
+      float elevation = (fine.required[i] - min_height) / range;
+      fine.cost[i] = 1.0f + params.slope_weight * slope + params.altitude_weight * elevation;
+      fine.required[i] += params.clearance;
+    }
+
+    // a coarse cell is as high as its highest and costs as much as its average fine cell
+    std::fill(coarse.required.begin(), coarse.required.end(), std::numeric_limits<float>::lowest());
+    std::fill(coarse.cost.begin(), coarse.cost.end(), 0.0f);
+    for (int y = 0; y < size; y++) {
+      for (int x = 0; x < size; x++) {
+        int i = (y / COARSE) * coarse.size + x / COARSE;
+        coarse.required[i] = std::max(coarse.required[i], fine.required[y * size + x]);
+        coarse.cost[i] += fine.cost[y * size + x] / (COARSE * COARSE);
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    cache.clear();
+  }
+
+  // plan a route on the calling thread
+  Plan plan(const Request& request)
+  {
+    Plan result{.agent = request.agent, .found = false, .waypoints = {}};
+    if (fine.size == 0) return result;
+
+    int start = fine.cell(request.start), goal = fine.cell(request.goal);
+
+    // the fine search only visits the fine cells inside the corridor of the coarse route
+    auto corridor = get_corridor(coarse.cell(request.start), coarse.cell(request.goal), request.ceiling);
+    std::vector<uint8_t> allowed(fine.cost.size(), 0);
+    for (int c : corridor) {
+      int cx = (c % coarse.size) * COARSE, cy = (c / coarse.size) * COARSE;
+      for (int y = cy; y < cy + COARSE; y++) {
+        for (int x = cx; x < cx + COARSE; x++) allowed[y * fine.size + x] = 1;
+      }
+    }
+
+    auto route = search(fine, start, goal, request.ceiling, corridor.empty() ? nullptr : &allowed);
+    if (route.empty() && !corridor.empty()) {
+      route = search(fine, start, goal, request.ceiling, nullptr);
+    }
+    if (route.empty()) return result;
+
+    // the altitude of a waypoint clears all cells on the leg towards it
+    result.found = true;
+    for (std::size_t i = 1; i < route.size(); i++) {
+      bool last = i + 1 == route.size();
+      auto point = last ? glm::vec2(request.goal.x, request.goal.z) : fine.center(route[i]);
+      float altitude = std::max(leg_altitude(route[i - 1], route[i]), last ? request.goal.y : 0.0f);
+      result.waypoints.push_back(glm::vec3(point.x, altitude, point.y));
+    }
+    return result;
+  }
+
+  // queue a request for the worker threads
+  void submit(const Request& request)
+  {
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex);
+      requests.push_back(request);
+    }
+    queue_changed.notify_one();
+  }
+
+  // move the finished plans to plans, returns the number of plans moved
+  int poll(std::vector<Plan>& plans)
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    int count = static_cast<int>(finished.size());
+    for (auto& plan : finished) plans.push_back(std::move(plan));
+    finished.clear();
+    return count;
+  }
+
+  // terrain plus clearance at a point
+  float get_required_altitude(const glm::vec3& point) const { return fine.required[fine.cell(point)]; }
+
+ private:
+  struct Level {
+    int size = 0;
+    float cell_size = 1.0f;
+    glm::vec2 origin{};
+    std::vector<float> required;  // lowest altitude that keeps the clearance over the whole cell
+    std::vector<float> cost;      // relative cost of flying through the cell, at least 1
+
+    Level() = default;
+    Level(int size, float cell_size, const glm::vec2& origin)
+        : size(size), cell_size(cell_size), origin(origin), required(size * size), cost(size * size)
+    {
+    }
+
+    int cell(const glm::vec3& point) const
+    {
+      auto xy = glm::clamp(glm::ivec2(glm::floor((glm::vec2(point.x, point.z) - origin) / cell_size)), 0, size - 1);
+      return xy.y * size + xy.x;
+    }
+
+    glm::vec2 center(int i) const { return origin + (glm::vec2(i % size, i / size) + 0.5f) * cell_size; }
+  };
+
+  Params params;
+  Level fine, coarse;
+
+  std::mutex cache_mutex;
+  std::unordered_map<uint64_t, std::vector<int>> cache;  // coarse corridors by start, goal and ceiling
+  static constexpr std::size_t MAX_CACHED = 4096;
+
+  std::vector<std::thread> workers;
+  std::mutex queue_mutex;
+  std::condition_variable queue_changed;
+  std::deque<Request> requests;
+  std::vector<Plan> finished;
+  bool stop = false;
+
+  void work()
+  {
+    while (true) {
+      Request request;
+      {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        queue_changed.wait(lock, [this]() { return stop || !requests.empty(); });
+        if (stop) return;
+        request = requests.front();
+        requests.pop_front();
+      }
+
+      auto result = plan(request);
+
+      std::lock_guard<std::mutex> lock(queue_mutex);
+      finished.push_back(std::move(result));
+    }
+  }
+
+  // coarse cells along the coarse route and their neighbors, empty if there is no coarse route
+  std::vector<int> get_corridor(int start, int goal, float ceiling)
+  {
+    // ceilings are rounded to 100 m, so agents at similar altitudes share routes
+    uint64_t band = static_cast<uint64_t>(std::max(ceiling, 0.0f) / 100.0f);
+    uint64_t key = (static_cast<uint64_t>(start) << 40) | (static_cast<uint64_t>(goal) << 16) | band;
+
+    {
+      std::lock_guard<std::mutex> lock(cache_mutex);
+      auto it = cache.find(key);
+      if (it != cache.end()) return it->second;
+    }
+
+    std::vector<int> corridor;
+    auto route = search(coarse, start, goal, ceiling, nullptr);
+    std::vector<uint8_t> marked(coarse.cost.size(), 0);
+
+    for (std::size_t i = 1; i < route.size(); i++) {
+      walk(coarse, route[i - 1], route[i], [&](int c) {
+        int cx = c % coarse.size, cy = c / coarse.size;
+        for (int y = std::max(cy - 1, 0); y <= std::min(cy + 1, coarse.size - 1); y++) {
+          for (int x = std::max(cx - 1, 0); x <= std::min(cx + 1, coarse.size - 1); x++) {
+            int n = y * coarse.size + x;
+            if (!marked[n]) marked[n] = 1, corridor.push_back(n);
+          }
+        }
+        return true;
+      });
+    }
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if (cache.size() >= MAX_CACHED) cache.clear();
+    cache[key] = corridor;
+    return corridor;
+  }
+
+  // visit all cells the line between the centers of two cells passes through, stops early if visit returns false
+  template <typename F>
+  static bool walk(const Level& level, int from, int to, F visit)
+  {
+    glm::ivec2 a(from % level.size, from / level.size), b(to % level.size, to / level.size);
+    glm::ivec2 delta = glm::abs(b - a), step(b.x > a.x ? 1 : -1, b.y > a.y ? 1 : -1);
+
+    if (!visit(from)) return false;
+
+    for (int x = 0, y = 0; x < delta.x || y < delta.y;) {
+      // compares the distances to the next vertical and horizontal cell border
+      int decision = (1 + 2 * x) * delta.y - (1 + 2 * y) * delta.x;
+      if (decision == 0) {
+        // the line passes exactly through a corner, the cells next to it are visited as well
+        if (!visit(a.y * level.size + a.x + step.x) || !visit((a.y + step.y) * level.size + a.x)) return false;
+        a += step, x++, y++;
+      } else if (decision < 0) {
+        a.x += step.x, x++;
+      } else {
+        a.y += step.y, y++;
+      }
+      if (!visit(a.y * level.size + a.x)) return false;
+    }
+    return true;
+  }
+
+  // cost of the straight line between two cells, or infinity if it crosses a blocked cell
+  static float line_cost(const Level& level, int from, int to, float ceiling, const std::vector<uint8_t>* allowed)
+  {
+    float sum = 0.0f;
+    int count = 0;
+    bool clear = walk(level, from, to, [&](int c) {
+      if (c != from && c != to && (level.required[c] > ceiling || (allowed && !(*allowed)[c]))) return false;
+      sum += level.cost[c], count++;
+      return true;
+    });
+    if (!clear) return std::numeric_limits<float>::infinity();
+    return glm::length(level.center(to) - level.center(from)) * sum / static_cast<float>(count);
+  }
+
+  // theta*, returns the cells where the route turns, from start to goal
+  static std::vector<int> search(const Level& level, int start, int goal, float ceiling,
+                                 const std::vector<uint8_t>* allowed)
+  {
+    const float infinity = std::numeric_limits<float>::infinity();
+    const std::size_t n = level.cost.size();
+    std::vector<float> g(n, infinity);
+    std::vector<int> parent(n, -1);
+    std::vector<uint8_t> closed(n, 0);
+
+    using Node = std::pair<float, int>;
+    std::priority_queue<Node, std::vector<Node>, std::greater<Node>> open;
+
+    auto goal_center = level.center(goal);
+    auto heuristic = [&](int c) { return glm::length(level.center(c) - goal_center); };
+
+    g[start] = 0.0f, parent[start] = start;
+    open.push({heuristic(start), start});
+
+    while (!open.empty()) {
+      int current = open.top().second;
+      open.pop();
+      if (closed[current]) continue;
+      closed[current] = 1;
+
+      if (current == goal) {
+        std::vector<int> route;
+        for (int c = goal; c != start; c = parent[c]) route.push_back(c);
+        route.push_back(start);
+        std::reverse(route.begin(), route.end());
+        return route;
+      }
+
+      int cx = current % level.size, cy = current / level.size;
+      for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+          int x = cx + dx, y = cy + dy;
+          if ((dx == 0 && dy == 0) || x < 0 || y < 0 || x >= level.size || y >= level.size) continue;
+
+          int next = y * level.size + x;
+          if (closed[next]) continue;
+          if (next != goal && (level.required[next] > ceiling || (allowed && !(*allowed)[next]))) continue;
+
+          // any angle: connect to the parent of the current cell directly if the line is clear
+          int from = parent[current];
+          float cost = g[from] + line_cost(level, from, next, ceiling, allowed);
+          if (cost == infinity) {
+            from = current;
+            float step = glm::length(glm::vec2(dx, dy)) * level.cell_size;
+            cost = g[current] + step * 0.5f * (level.cost[current] + level.cost[next]);
+          }
+
+          if (cost < g[next]) {
+            g[next] = cost, parent[next] = from;
+            open.push({cost + heuristic(next), next});
+          }
+        }
+      }
+    }
+
+    return {};
+  }
+
+  // highest required altitude of the cells on a leg
+  float leg_altitude(int from, int to) const
+  {
+    float altitude = std::numeric_limits<float>::lowest();
+    walk(fine, from, to, [&](int c) {
+      altitude = std::max(altitude, fine.required[c]);
+      return true;
+    });
+    return altitude;
+  }
+};
@@ -0,0 +1,224 @@
+/*
+    point mass projectiles and proportional navigation missiles
+*/
+#pragma once
+
+#include <algorithm>
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "collider.h"
+#include "kdtree.h"
+#include "phi.h"
+
+class ProjectileSystem
+{
+ public:
+  enum Type : uint8_t { BULLET, MISSILE };
+
+  struct Hit {
+    Type type;
+    int owner;        // index of the shooter, -1 if there is none
+    int target;       // index of the target that was hit
+    glm::vec3 point;  // position of the projectile at impact
+  };
+
+  struct Params {
+    float lifetime;
+    float radius;      // collision radius, m
+    float drag;        // 0.5 * air density * drag coefficient * area / mass at sea level, 1/m
+    float thrust;      // acceleration while the motor burns, m/s^2
+    float burn_time;   // s
+    float navigation;  // proportional navigation constant, usually between 3 and 5
+    float max_g;       // maximum lateral acceleration in g
+  };
+
+  // 20mm round and a short range heat seeker
+  Params bullet = {.lifetime = 3.0f,
+                   .radius = 0.5f,
+                   .drag = 0.0004f,
+                   .thrust = 0.0f,
+                   .burn_time = 0.0f,
+                   .navigation = 0.0f,
+                   .max_g = 0.0f};
+  Params missile = {.lifetime = 20.0f,
+                    .radius = 5.0f,
+                    .drag = 0.0002f,
+                    .thrust = 250.0f,
+                    .burn_time = 5.0f,
+                    .navigation = 4.0f,
+                    .max_g = 30.0f};
+
+  // all storage is allocated up front, firing never allocates
+  ProjectileSystem(std::size_t capacity) : capacity(capacity)
+  {
+    position.resize(capacity);
+    velocity.resize(capacity);
+    age.resize(capacity);
+    type.resize(capacity);
+    owner.resize(capacity);
+    target.resize(capacity);
+    hits.reserve(capacity);
+  }
+
+  std::size_t size() const { return count; }
+
+  std::size_t get_capacity() const { return capacity; }
+
+  // returns false if the pool is full
+  bool fire(Type projectile_type, const glm::vec3& pos, const glm::vec3& vel, int shooter = -1, int target_index = -1)
+  {
+    if (count == capacity) return false;
+
+    position[count] = pos;
+    velocity[count] = vel;
+    age[count] = 0.0f;
+    type[count] = projectile_type;
+    owner[count] = shooter;
+    target[count] = target_index;
+    count++;
+    return true;
+  }
+
+  // integrate all projectiles and test them against the targets, which must have already been moved by dt.
+  // the hits of this step can be read from get_hits()
+  template <typename RB>
+  void update(phi::Seconds dt, const std::vector<RB>& targets, float target_radius)
+  {
+    hits.clear();
+
+    if (!targets.empty()) {
+      kdtree.build(targets);
+    }
+
+    max_target_speed = 0.0f;
+    for (const auto& rb : targets) {
+      max_target_speed = std::max(max_target_speed, rb.get_speed());
+    }
+
+    for (std::size_t i = 0; i < count;) {
+      const Params& params = (type[i] == MISSILE) ? missile : bullet;
+
+      // point mass with quadratic drag, air gets thinner with altitude
+      glm::vec3 acceleration(0.0f, -phi::EARTH_GRAVITY, 0.0f);
+
+      if (type[i] == MISSILE && target[i] >= 0) {
+        acceleration += guide(i, targets[target[i]].position, targets[target[i]].velocity, params);
+      }
+
+      float speed = glm::length(velocity[i]);
+      float density_ratio = std::exp(-std::max(position[i].y, 0.0f) / 8500.0f);
+      acceleration -= params.drag * density_ratio * speed * velocity[i];
+
+      if (type[i] == MISSILE && age[i] < params.burn_time && speed > phi::EPSILON) {
+        acceleration += (velocity[i] / speed) * params.thrust;
+      }
+
+      glm::vec3 previous = position[i];
+      velocity[i] += acceleration * dt;
+      position[i] += velocity[i] * dt;
+      age[i] += dt;
+
+      bool hit = !targets.empty() && test_hit(i, previous, dt, targets, target_radius, params.radius);
+
+      if (hit || age[i] >= params.lifetime) {
+        remove(i);  // moves the last projectile into slot i, so i is not advanced
+      } else {
+        i++;
+      }
+    }
+  }
+
+  const std::vector<Hit>& get_hits() const { return hits; }
+
+  const glm::vec3& get_position(std::size_t index) const { return position[index]; }
+
+  void clear() { count = 0; }
+
+ private:
+  const std::size_t capacity;
+  std::size_t count = 0;
+
+  // projectiles are kept densely packed in [0, count)
+  std::vector<glm::vec3> position;
+  std::vector<glm::vec3> velocity;
+  std::vector<float> age;
+  std::vector<Type> type;
+  std::vector<int> owner;
+  std::vector<int> target;
+
+  std::vector<Hit> hits;
+  std::vector<int> candidates;
+  collider::KDTree kdtree;
+  float max_target_speed = 0.0f;
+
+  void remove(std::size_t i)
+  {
+    count--;
+    position[i] = position[count];
+    velocity[i] = velocity[count];
+    age[i] = age[count];
+    type[i] = type[count];
+    owner[i] = owner[count];
+    target[i] = target[count];
+  }
+
+  // pure proportional navigation, turns the missile's own velocity at N times the line of sight rate, so the
+  // acceleration is perpendicular to the velocity of the missile rather than to the line of sight
+  glm::vec3 guide(std::size_t i, const glm::vec3& target_position, const glm::vec3& target_velocity,
+                  const Params& params) const
+  {
+    auto line_of_sight = target_position - position[i];
+    auto relative_velocity = target_velocity - velocity[i];
+    float distance_sq = glm::dot(line_of_sight, line_of_sight);
+
+    if (distance_sq < phi::EPSILON) return glm::vec3(0.0f);
+
+    auto rotation = glm::cross(line_of_sight, relative_velocity) / distance_sq;
+    auto acceleration = params.navigation * glm::cross(rotation, velocity[i]);
+
+    float max_acceleration = params.max_g * phi::EARTH_GRAVITY;
+    float magnitude = glm::length(acceleration);
+    if (magnitude > max_acceleration) {
+      acceleration *= max_acceleration / magnitude;
+    }
+
+    return acceleration;
+  }
+
+  template <typename RB>
+  bool test_hit(std::size_t i, const glm::vec3& previous, phi::Seconds dt, const std::vector<RB>& targets,
+                float target_radius, float radius)
+  {
+    auto displacement = position[i] - previous;
+
+    // only targets that can be reached during this step need to be checked
+    float reach = glm::length(displacement) + radius + target_radius + max_target_speed * dt;
+    candidates.clear();
+    kdtree.within_radius(previous, reach, candidates, owner[i]);
+
+    for (int candidate : candidates) {
+      const auto& rb = targets[candidate];
+      auto target_displacement = rb.velocity * dt;
+
+      collider::Sphere a(previous, radius);
+      collider::Sphere b(rb.position - target_displacement, target_radius);
+
+      // without moving relative to each other they only hit if they already overlap
+      bool hit;
+      if (glm::length(displacement - target_displacement) < phi::EPSILON) {
+        auto d = a.center - b.center;
+        hit = glm::dot(d, d) <= (radius + target_radius) * (radius + target_radius);
+      } else {
+        hit = collider::test_moving_collision(a, displacement, b, target_displacement);
+      }
+
+      if (hit) {
+        hits.push_back({type[i], owner[i], candidate, position[i]});
+        return true;
+      }
+    }
+
+    return false;
+  }
+};
@@ -0,0 +1,295 @@
+/*
+    asynchronous streaming of terrain tiles with an lru cache
+*/
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <glm/glm.hpp>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// tile in the zoom/x/y layout of web map tiles, y grows to the south
+struct TileKey {
+  int zoom = 0, x = 0, y = 0;
+
+  bool operator==(const TileKey& other) const = default;
+
+  struct Hash {
+    std::size_t operator()(const TileKey& key) const
+    {
+      return std::hash<uint64_t>()((static_cast<uint64_t>(key.zoom) << 48) ^ (static_cast<uint64_t>(key.x) << 24) ^
+                                   static_cast<uint64_t>(key.y));
+    }
+  };
+};
+
+// decoded image, channels bytes per pixel, rows from top to bottom
+struct Image {
+  int width = 0, height = 0, channels = 0;
+  std::vector<uint8_t> pixels;
+};
+
+struct TerrainTile {
+  TileKey key;
+  Image heightmap, normalmap, texture;
+
+  std::size_t bytes() const { return heightmap.pixels.size() + normalmap.pixels.size() + texture.pixels.size(); }
+};
+
+// indexes the zoom/x/y/ tile directories under root and loads the tiles around the camera and around where the camera
+// will be in lookahead seconds on worker threads. loaded tiles are kept in an lru cache, tiles that are not wanted
+// anymore are evicted once the decoded tiles take more than the memory budget. all methods must be called from the
+// same thread, only the decoding runs on the workers
+class TerrainStreamer
+{
+ public:
+  // decodes the image at path, returns false if it could not be loaded. called from the worker threads
+  using Loader = std::function<bool(const std::string& path, Image& image)>;
+
+  std::size_t budget = std::size_t(256) << 20;  // bytes of decoded tiles kept in memory
+  float radius = 30000.0f;                      // tiles closer than this to the camera are loaded, m
+  float lookahead = 60.0f;                      // s
+
+  // root ends with a slash. the origin tile is centered at the world origin, base_size is the width of a tile at
+  // base_zoom in meters
+  TerrainStreamer(const std::string& root, const TileKey& origin, float base_size, int base_zoom, Loader loader,
+                  int num_threads = 2)
+      : root(root), origin(origin), base_size(base_size), base_zoom(base_zoom), loader(std::move(loader))
+  {
+    namespace fs = std::filesystem;
+    std::error_code error;
+
+    // a tile is usable if it has all three images
+    for (const auto& zoom : fs::directory_iterator(root, error)) {
+      for (const auto& x : fs::directory_iterator(zoom.path(), error)) {
+        for (const auto& y : fs::directory_iterator(x.path(), error)) {
+          if (!fs::exists(y.path() / "heightmap.png") || !fs::exists(y.path() / "normalmap.png") ||
+              !fs::exists(y.path() / "texture.png")) {
+            continue;
+          }
+          try {
+            index.push_back({std::stoi(zoom.path().filename().string()), std::stoi(x.path().filename().string()),
+                             std::stoi(y.path().filename().string())});
+          } catch (const std::exception&) {
+            // not a tile directory
+          }
+        }
+      }
+    }
+
+    for (int i = 0; i < num_threads; i++) workers.emplace_back([this]() { work(); });
+  }
+
+  ~TerrainStreamer()
+  {
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex);
+      stop = true;
+    }
+    queue_changed.notify_all();
+    for (auto& worker : workers) worker.join();
+  }
+
+  // all usable tiles found under root
+  const std::vector<TileKey>& get_index() const { return index; }
+
+  // width of a tile in meters
+  float get_size(int zoom) const { return base_size * std::exp2(static_cast<float>(base_zoom - zoom)); }
+
+  // world position of the center of a tile, x and y of the tile map to x and z in the world
+  glm::vec2 get_center(const TileKey& key) const
+  {
+    auto center = [this](const TileKey& tile) { return (glm::vec2(tile.x, tile.y) + 0.5f) * get_size(tile.zoom); };
+    return center(key) - center(origin);
+  }
+
+  // the indexed tile at the highest zoom level that contains the point, zoom is -1 if there is none
+  TileKey find(const glm::vec2& point) const
+  {
+    TileKey best{.zoom = -1};
+    for (const auto& key : index) {
+      auto offset = glm::abs(point - get_center(key));
+      if (key.zoom > best.zoom && std::max(offset.x, offset.y) <= 0.5f * get_size(key.zoom)) best = key;
+    }
+    return best;
+  }
+
+  // requests the tiles around the camera and its predicted position, moves finished tiles into the cache and evicts
+  // old tiles. call once per frame
+  void update(const glm::vec3& position, const glm::vec3& velocity)
+  {
+    glm::vec2 now(position.x, position.z);
+    glm::vec2 ahead = now + glm::vec2(velocity.x, velocity.z) * lookahead;
+
+    // the tiles around the camera come first, then the ones around the predicted position
+    wanted.clear();
+    for (const auto& key : index) {
+      float distance = distance_to(key, now), distance_ahead = distance_to(key, ahead);
+      if (distance < radius) {
+        wanted.push_back({key, distance});
+      } else if (distance_ahead < radius) {
+        wanted.push_back({key, radius + distance_ahead});
+      }
+    }
+    std::sort(wanted.begin(), wanted.end(), [](const auto& a, const auto& b) { return a.second < b.second; });
+
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex);
+
+      added.clear();
+      for (auto& tile : finished) {
+        added.push_back(tile.key);
+        loading.erase(tile.key);
+        memory += tile.bytes();
+        lru.push_front(std::move(tile));
+        cache[lru.front().key] = lru.begin();
+      }
+      finished.clear();
+
+      // tiles that could not be decoded are not requested again, the files would not decode the next time either
+      for (const auto& key : failed) {
+        loading.erase(key);
+        broken.insert(key);
+      }
+      failed.clear();
+
+      // requests that did not start yet are replaced, so tiles that are not wanted anymore are never loaded
+      for (const auto& key : requests) loading.erase(key);
+      requests.clear();
+      for (const auto& [key, distance] : wanted) {
+        if (!cache.contains(key) && !loading.contains(key) && !broken.contains(key)) {
+          requests.push_back(key);
+          loading.insert(key);
+        }
+      }
+    }
+    queue_changed.notify_all();
+
+    // the closest tile ends up as the most recently used
+    for (auto it = wanted.rbegin(); it != wanted.rend(); ++it) touch(it->first);
+    evict();
+  }
+
+  // the decoded tile or nullptr if it is not loaded yet, counts as a use of the tile
+  const TerrainTile* get(const TileKey& key)
+  {
+    auto it = cache.find(key);
+    if (it == cache.end()) return nullptr;
+    lru.splice(lru.begin(), lru, it->second);
+    return &*it->second;
+  }
+
+  // whether the tile is in the cache, does not count as a use of the tile
+  bool contains(const TileKey& key) const { return cache.contains(key); }
+
+  // the loaded tiles that overlap the rectangle of world x and z from min to max, highest zoom first. does not count
+  // as a use of the tiles, the pointers are valid until the next update()
+  void find_tiles(const glm::vec2& min, const glm::vec2& max, std::vector<const TerrainTile*>& tiles) const
+  {
+    tiles.clear();
+    for (const auto& tile : lru) {
+      glm::vec2 lo = get_center(tile.key) - 0.5f * get_size(tile.key.zoom);
+      glm::vec2 hi = get_center(tile.key) + 0.5f * get_size(tile.key.zoom);
+      if (lo.x <= max.x && lo.y <= max.y && min.x <= hi.x && min.y <= hi.y) tiles.push_back(&tile);
+    }
+    std::sort(tiles.begin(), tiles.end(), [](const auto* a, const auto* b) { return a->key.zoom > b->key.zoom; });
+  }
+
+  // tiles that were moved into the cache by the last update()
+  const std::vector<TileKey>& get_added() const { return added; }
+
+  std::size_t get_memory() const { return memory; }
+
+  std::size_t size() const { return cache.size(); }
+
+ private:
+  const std::string root;
+  const TileKey origin;
+  const float base_size;
+  const int base_zoom;
+  const Loader loader;
+  std::vector<TileKey> index;
+
+  // the cache, most recently used first
+  std::list<TerrainTile> lru;
+  std::unordered_map<TileKey, std::list<TerrainTile>::iterator, TileKey::Hash> cache;
+  std::size_t memory = 0;
+  std::vector<std::pair<TileKey, float>> wanted;  // tiles and their distance, closest first
+  std::vector<TileKey> added;
+
+  std::vector<std::thread> workers;
+  std::mutex queue_mutex;
+  std::condition_variable queue_changed;
+  std::deque<TileKey> requests;                        // closest first
+  std::unordered_set<TileKey, TileKey::Hash> loading;  // requested or being loaded
+  std::vector<TerrainTile> finished;
+  std::vector<TileKey> failed;                        // could not be decoded since the last update()
+  std::unordered_set<TileKey, TileKey::Hash> broken;  // could not be decoded, never requested again
+  bool stop = false;
+
+  float distance_to(const TileKey& key, const glm::vec2& point) const
+  {
+    auto offset = glm::max(glm::abs(point - get_center(key)) - 0.5f * get_size(key.zoom), glm::vec2(0.0f));
+    return glm::length(offset);
+  }
+
+  void touch(const TileKey& key)
+  {
+    auto it = cache.find(key);
+    if (it != cache.end()) lru.splice(lru.begin(), lru, it->second);
+  }
+
+  // drops the least recently used tiles until the cache fits the budget, wanted tiles are kept even if they don't
+  // fit, since they would be loaded again right away
+  void evict()
+  {
+    auto it = lru.end();
+    while (memory > budget && it != lru.begin()) {
+      --it;
+      bool is_wanted = std::any_of(wanted.begin(), wanted.end(), [&](const auto& w) { return w.first == it->key; });
+      if (is_wanted) continue;
+
+      memory -= it->bytes();
+      cache.erase(it->key);
+      it = lru.erase(it);
+    }
+  }
+
+  void work()
+  {
+    while (true) {
+      TileKey key;
+      {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        queue_changed.wait(lock, [this]() { return stop || !requests.empty(); });
+        if (stop) return;
+        key = requests.front();
+        requests.pop_front();
+      }
+
+      TerrainTile tile{.key = key, .heightmap = {}, .normalmap = {}, .texture = {}};
+      auto path = root + std::to_string(key.zoom) + "/" + std::to_string(key.x) + "/" + std::to_string(key.y) + "/";
+      bool loaded = loader(path + "heightmap.png", tile.heightmap);
+      loaded = loader(path + "normalmap.png", tile.normalmap) && loaded;
+      loaded = loader(path + "texture.png", tile.texture) && loaded;
+
+      std::lock_guard<std::mutex> lock(queue_mutex);
+      if (loaded) {
+        finished.push_back(std::move(tile));
+      } else {
+        failed.push_back(key);
+      }
+    }
+  }
+};
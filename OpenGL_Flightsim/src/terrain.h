@@ -1,276 +1,525 @@
 #pragma once
 
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "cdlod.h"
+#include "clipmap.h"
+#include "collider.h"
 #include "gfx.h"
+#include "streamer.h"
 
 constexpr unsigned int primitive_restart = 0xFFFFU;
 const float MAX_TILE_SIZE = 50708.0f * 4;
 
 #define DATA_SRC 0
 
+// the tile centered at the world origin, MAX_TILE_SIZE is the width of a tile at zoom 9
+const std::string TERRAIN_ROOT = "assets/textures/terrain/data/";
+const int TERRAIN_BASE_ZOOM = 9;
+
 #if (DATA_SRC == 1)
-const std::string PATH = "assets/textures/terrain/data/9/268/178/";
-const int ZOOM_FACTOR = 1;
+const TileKey TERRAIN_ORIGIN = {9, 268, 178};
 #elif (DATA_SRC == 2)
 // vienna
-const std::string PATH = "assets/textures/terrain/data/10/557/354/";
-const int ZOOM_FACTOR = 2;
+const TileKey TERRAIN_ORIGIN = {10, 557, 354};
 #else
 // vorarlberg
-const std::string PATH = "assets/textures/terrain/data/10/536/356/";
-const int ZOOM_FACTOR = 2;
+const TileKey TERRAIN_ORIGIN = {10, 536, 356};
 #endif
 
-const gfx::gl::TextureParams params = {.texture_wrap = GL_REPEAT, .texture_mag_filter = GL_LINEAR};
+// the clipmap textures are toroidal and have no mipmaps, the levels of the stack take their place
+const gfx::gl::TextureParams params = {
+    .texture_wrap = GL_REPEAT, .texture_min_filter = GL_LINEAR, .texture_mag_filter = GL_LINEAR};
+
+// the meshes of all blocks in one vertex and one index buffer. vertices are grid coordinates in segments and indices
+// are relative to the first vertex of their mesh, both 16 bit. every kind of block has one mesh, the rotated fixups and
+// trims share it with the unrotated ones
+struct ClipmapMeshes {
+  struct Mesh {
+    GLenum mode;
+    GLsizei index_count;
+    std::size_t first_index;
+    GLint base_vertex;
+  };
 
-struct Seam {
   gfx::gl::VertexBuffer vbo;
+  gfx::gl::VertexBuffer instances;
+  gfx::gl::ElementBufferObject ebo;
   gfx::gl::VertexArrayObject vao;
-  unsigned int index_count;
+  std::array<Mesh, ClipmapLayout::BLOCKS> meshes;
+  std::size_t memory = 0;  // bytes of vertices and indices
 
-  Seam(int columns, float size)
+  ClipmapMeshes(const ClipmapLayout& layout)
   {
-    int rows = 1;
-    index_count = columns;
+    std::vector<uint16_t> vertices, indices;
+
+    for (int block = 0; block < ClipmapLayout::BLOCKS; block++) {
+      auto extent = glm::ivec2(layout.extent(static_cast<ClipmapLayout::Block>(block)));
+
+      Mesh mesh = {.mode = GL_TRIANGLE_STRIP,
+                   .index_count = 0,
+                   .first_index = indices.size(),
+                   .base_vertex = static_cast<GLint>(vertices.size() / 2)};
+      assert(static_cast<unsigned int>((extent.x + 1) * (extent.y + 1)) < primitive_restart);
 
-    std::vector<glm::vec3> vertices;
+      for (int z = 0; z <= extent.y; z++) {
+        for (int x = 0; x <= extent.x; x++) {
+          vertices.push_back(x);
+          vertices.push_back(z);
+        }
+      }
 
-    int x;
-    for (x = 0; x < columns; x++) {
-      vertices.push_back({x * size, 0.0f, 0 * size});
-      vertices.push_back({x * size + size / 2.0f, size, 0 * size});
-      vertices.push_back({x * size + size, 0.0f, 0 * size});
+      if (extent.y == 0) {
+        // the seam is a row of triangles whose tips are on the vertices between the ones of the coarser level
+        mesh.mode = GL_TRIANGLES;
+        for (int x = 0; x + 2 <= extent.x; x += 2) {
+          indices.push_back(x);
+          indices.push_back(x + 1);
+          indices.push_back(x + 2);
+        }
+      } else {
+        for (int r = 0; r < extent.y; r++) {
+          for (int c = 0; c <= extent.x; c++) {
+            indices.push_back((r + 0) * (extent.x + 1) + c);
+            indices.push_back((r + 1) * (extent.x + 1) + c);
+          }
+          indices.push_back(primitive_restart);  // restart primitive
+        }
+      }
+
+      mesh.index_count = static_cast<GLsizei>(indices.size() - mesh.first_index);
+      meshes[block] = mesh;
     }
 
+    memory = (vertices.size() + indices.size()) * sizeof(uint16_t);
+
     vao.bind();
-    vbo.buffer(&vertices[0], vertices.size() * sizeof(vertices[0]));
+    vbo.buffer(vertices.data(), vertices.size() * sizeof(vertices[0]));
+    ebo.buffer(indices.data(), indices.size() * sizeof(indices[0]));
 
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
+    glVertexAttribPointer(0, 2, GL_UNSIGNED_SHORT, GL_FALSE, 2 * sizeof(uint16_t), (void*)0);
     glEnableVertexAttribArray(0);
+    instances.bind();
+    glEnableVertexAttribArray(1);
+    glVertexAttribDivisor(1, 1);
+    glEnableVertexAttribArray(2);
+    glVertexAttribDivisor(2, 1);
 
     vao.unbind();
   }
 
-  void bind() { vao.bind(); }
+  // one upload for the instances of all blocks and one draw per block
+  void draw(const ClipmapLayout& layout)
+  {
+    placements.clear();
+    for (int block = 0; block < ClipmapLayout::BLOCKS; block++) {
+      const auto& list = layout.get(static_cast<ClipmapLayout::Block>(block));
+      placements.insert(placements.end(), list.begin(), list.end());
+    }
+    if (placements.empty()) return;
 
-  void unbind() { vao.unbind(); }
+    vao.bind();
+    instances.buffer(placements.data(), placements.size() * sizeof(placements[0]), GL_STREAM_DRAW);
+
+    std::size_t first = 0;
+    for (int block = 0; block < ClipmapLayout::BLOCKS; block++) {
+      const auto count = layout.get(static_cast<ClipmapLayout::Block>(block)).size();
+      if (count == 0) continue;
+
+      // there is no base instance in opengl 3.3, the instance attributes start at the first instance of the block
+      const std::size_t offset = first * sizeof(ClipmapInstance);
+      glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(ClipmapInstance),
+                            (void*)(offset + offsetof(ClipmapInstance, offset)));
+      glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, sizeof(ClipmapInstance),
+                            (void*)(offset + offsetof(ClipmapInstance, level)));
+
+      const auto& mesh = meshes[block];
+      glDrawElementsInstancedBaseVertex(mesh.mode, mesh.index_count, GL_UNSIGNED_SHORT,
+                                        (void*)(mesh.first_index * sizeof(uint16_t)), count, mesh.base_vertex);
+      first += count;
+    }
 
-  void draw()
-  {
-    bind();
-    // glDrawElements(GL_TRIANGLE_STRIP, index_count, GL_UNSIGNED_INT, 0);
-    glDrawArrays(GL_TRIANGLES, 0, 3 * index_count);
-    unbind();
+    vao.unbind();
   }
+
+ private:
+  std::vector<ClipmapInstance> placements;
 };
 
-struct Block {
+// the grid of the cdlod nodes. vertices are 16 bit grid coordinates, the triangles are sorted by the quarter of the
+// node, so a quarter is drawn with a quarter of the indices
+struct CdlodMesh {
   gfx::gl::VertexBuffer vbo;
+  gfx::gl::VertexBuffer instances;
   gfx::gl::ElementBufferObject ebo;
   gfx::gl::VertexArrayObject vao;
-  unsigned int index_count;
+  const int grid;
+  std::size_t memory = 0;  // bytes of vertices and indices
 
-  Block(int width, int height, float segment_size)
+  CdlodMesh(int grid) : grid(grid)
   {
-#if 1
-    std::vector<glm::vec3> vertices;
-    std::vector<unsigned int> indices;
+    std::vector<uint16_t> vertices, indices;
+    assert((grid + 1) * (grid + 1) < primitive_restart && grid % 2 == 0);
 
-    for (int y = 0; y <= width; y++) {
-      for (int x = 0; x <= height; x++) {
-        vertices.push_back({x * segment_size, 0.0f, y * segment_size});
+    for (int z = 0; z <= grid; z++) {
+      for (int x = 0; x <= grid; x++) {
+        vertices.push_back(x);
+        vertices.push_back(z);
       }
     }
 
-    for (int r = 0; r < width; r++) {
-      for (int c = 0; c < height + 1; c++) {
-        auto i0 = (r + 0) * (height + 1) + c;
-        indices.push_back(i0);
-
-        auto i1 = (r + 1) * (height + 1) + c;
-        indices.push_back(i1);
+    const int half = grid / 2;
+    for (int q = 0; q < 4; q++) {
+      const int x0 = (q & 1) * half, z0 = (q >> 1) * half;
+      for (int z = z0; z < z0 + half; z++) {
+        for (int x = x0; x < x0 + half; x++) {
+          const int i = z * (grid + 1) + x;
+          for (int corner : {i, i + grid + 1, i + 1, i + 1, i + grid + 1, i + grid + 2}) indices.push_back(corner);
+        }
       }
-      indices.push_back(primitive_restart);  // restart primitive
     }
 
-    index_count = indices.size();
-
-    assert(indices.size() > 0 && vertices.size() > 0);
+    memory = (vertices.size() + indices.size()) * sizeof(uint16_t);
 
     vao.bind();
+    vbo.buffer(vertices.data(), vertices.size() * sizeof(vertices[0]));
+    ebo.buffer(indices.data(), indices.size() * sizeof(indices[0]));
 
-    vbo.buffer(&vertices[0], vertices.size() * sizeof(vertices[0]));
-    ebo.buffer(&indices[0], indices.size() * sizeof(indices[0]));
-
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
+    glVertexAttribPointer(0, 2, GL_UNSIGNED_SHORT, GL_FALSE, 2 * sizeof(uint16_t), (void*)0);
     glEnableVertexAttribArray(0);
+    instances.bind();
+    glEnableVertexAttribArray(1);
+    glVertexAttribDivisor(1, 1);
 
     vao.unbind();
-#endif
   }
 
-  void bind() { vao.bind(); }
+  // one upload for all nodes and one draw per part
+  void draw(const CdlodQuadtree& quadtree)
+  {
+    placements.clear();
+    for (int part = 0; part < CdlodQuadtree::PARTS; part++) {
+      const auto& list = quadtree.get(static_cast<CdlodQuadtree::Part>(part));
+      placements.insert(placements.end(), list.begin(), list.end());
+    }
+    if (placements.empty()) return;
+
+    vao.bind();
+    instances.buffer(placements.data(), placements.size() * sizeof(placements[0]), GL_STREAM_DRAW);
 
-  void unbind() { vao.unbind(); }
+    const std::size_t quarter = 6 * std::size_t(grid / 2) * (grid / 2);
+    std::size_t first = 0;
+    for (int part = 0; part < CdlodQuadtree::PARTS; part++) {
+      const auto count = quadtree.get(static_cast<CdlodQuadtree::Part>(part)).size();
+      if (count == 0) continue;
 
-  void draw()
-  {
-    bind();
-    glDrawElements(GL_TRIANGLE_STRIP, index_count, GL_UNSIGNED_INT, 0);
-    unbind();
+      glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(CdlodNode), (void*)(first * sizeof(CdlodNode)));
+
+      const std::size_t first_index = (part == CdlodQuadtree::WHOLE) ? 0 : (part - CdlodQuadtree::QUARTER_0) * quarter;
+      const std::size_t index_count = (part == CdlodQuadtree::WHOLE) ? 4 * quarter : quarter;
+      glDrawElementsInstanced(GL_TRIANGLES, index_count, GL_UNSIGNED_SHORT, (void*)(first_index * sizeof(uint16_t)),
+                              count);
+      first += count;
+    }
+
+    vao.unbind();
   }
+
+ private:
+  std::vector<CdlodNode> placements;
 };
 
-class Clipmap : public gfx::Object3D
+// the streamed terrain. the renderers draw from the texture stack, which is filled from all tiles in the streamer
+// cache, and the collision queries read the same tiles: every point is answered by the highest resolution loaded tile
+// that contains it, like the texels of the stack. terrain that is not loaded yet is at sea level
+class Terrain : public gfx::Object3D
 {
  public:
   bool wireframe = false;
 
-  Clipmap(int levels = 16, int segments = 32, float segment_size = 2.0f)
-      : shader("shaders/terrain"),
-        heightmap(PATH + "heightmap.png", params),
-        normalmap(PATH + "normalmap.png", params),
-        terrain(PATH + "texture.png", params),
-        levels(levels),
-        segments(segments),
-        segment_size(segment_size),
-        tile(segments, segments, segment_size),
-        col_fixup(2, segments, segment_size),
-        row_fixup(segments, 2, segment_size),
-        horizontal(2 * segments + 2, 1, segment_size),
-        vertical(1, 2 * segments + 2, segment_size),
-        center(2 * segments + 2, 2 * segments + 2, segment_size),
-        seam(2 * segments + 2, segment_size * 2),
-        terrain_size(MAX_TILE_SIZE / ZOOM_FACTOR)
+  Terrain(TerrainStreamer& streamer, int levels, float spacing)
+      : streamer(streamer),
+        stack(stack_size, levels, spacing),
+        heightmap(stack_size, stack_size, levels, GL_R16, GL_RED, GL_UNSIGNED_SHORT, params),
+        normalmap(stack_size, stack_size, levels, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, params),
+        terrain(stack_size, stack_size, levels, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, params)
+  {
+  }
+
+  // copies the heights of the tiles that the last TerrainStreamer::update() loaded for the collision queries and drops
+  // the tiles it evicted. call after it once per frame
+  void update()
+  {
+    std::erase_if(tiles, [this](const auto& tile) { return !streamer.contains(tile->key); });
+
+    for (const auto& key : streamer.get_added()) {
+      const TerrainTile* loaded = streamer.get(key);
+      if (loaded == nullptr || loaded->heightmap.pixels.empty()) continue;
+
+      std::erase_if(tiles, [&key](const auto& tile) { return tile->key == key; });
+      auto tile = std::make_unique<CollisionTile>(key, streamer.get_center(key), streamer.get_size(key.zoom),
+                                                  loaded->heightmap);
+      auto coarser = [&key](const auto& other) { return other->key.zoom < key.zoom; };
+      tiles.insert(std::find_if(tiles.begin(), tiles.end(), coarser), std::move(tile));
+    }
+  }
+
+  float get_terrain_height(glm::vec2 coords) const
+  {
+    const CollisionTile* tile = find_tile(coords);
+    return tile ? tile->heights.get_height(coords) : 0.0f;
+  }
+
+  glm::vec3 get_terrain_normal(glm::vec2 coords) const
+  {
+    const CollisionTile* tile = find_tile(coords);
+    return tile ? tile->heights.get_normal(coords) : glm::vec3(0.0f, 1.0f, 0.0f);
+  }
+
+  // batched get_terrain_height() under the x and z of the points
+  void get_heights(const std::vector<glm::vec3>& points, std::vector<float>& heights) const
+  {
+    heights.resize(points.size());
+    for (std::size_t i = 0; i < points.size(); i++) {
+      heights[i] = get_terrain_height(glm::vec2(points[i].x, points[i].z));
+    }
+  }
+
+  // batched segment queries like collider::HeightmapPyramid::raycast(), t[i] is in [0, 1] along from[i] -> to[i], or
+  // -1 if the segment does not hit the terrain raised by lift. every part of a segment is tested against the tile that
+  // answers the height queries there
+  void raycast(const std::vector<glm::vec3>& from, const std::vector<glm::vec3>& to, std::vector<float>& t,
+               float lift = 0.0f) const
+  {
+    assert(from.size() == to.size());
+    t.resize(from.size());
+    std::vector<glm::vec2> covered;
+    for (std::size_t i = 0; i < from.size(); i++) t[i] = raycast(from[i], to[i] - from[i], lift, covered);
+  }
+
+  // blocks or nodes drawn and culled in the last frame
+  virtual int get_drawn() const = 0;
+  virtual int get_culled() const = 0;
+
+  // bytes of vertices and indices of the meshes
+  virtual std::size_t get_memory() const = 0;
+
+  // drawn before the meshes of the scene
+  void enqueue(gfx::RenderQueue& queue, const gfx::RenderContext& context) override
+  {
+    if (!context.is_shadow_pass) queue.add(this, gfx::RenderQueue::SCENE);
+  }
+
+ protected:
+  static constexpr int stack_size = 256;       // texels along one side of a level of the stack
+  static constexpr float height_scale = 3000;  // m, height of the largest heightmap value, same as in the shaders
+
+  TerrainStreamer& streamer;
+  ClipmapTextures stack;
+  gfx::gl::TextureArray heightmap;
+  gfx::gl::TextureArray normalmap;
+  gfx::gl::TextureArray terrain;
+
+  float get_height_above_ground(const glm::vec3& camera_pos) const
+  {
+    return std::max(camera_pos.y - get_terrain_height(glm::vec2(camera_pos.x, camera_pos.z)), 0.0f);
+  }
+
+  // moves the levels from first to last of the stack to the camera, only the texels that came into view or were
+  // loaded are uploaded
+  void update_stack(const glm::vec3& camera_pos, int first, int last)
+  {
+    stack.update(glm::vec2(camera_pos.x, camera_pos.z), first, last, streamer);
+
+    for (const auto& region : stack.get_regions()) {
+      std::size_t offset = std::size_t(region.y) * stack.size + region.x;
+      heightmap.update(region.level, region.x, region.y, region.width, region.height,
+                       stack.get_heights(region.level) + offset, stack.size);
+      normalmap.update(region.level, region.x, region.y, region.width, region.height,
+                       stack.get_normals(region.level) + 4 * offset, stack.size);
+      terrain.update(region.level, region.x, region.y, region.width, region.height,
+                     stack.get_colors(region.level) + 4 * offset, stack.size);
+    }
+    stack.clear_regions();
+  }
+
+  // the shader must be bound
+  void bind_textures(gfx::gl::Shader& shader)
   {
+    heightmap.bind(2);
+    normalmap.bind(3);
+    terrain.bind(4);
+    shader.uniform("u_Heightmap", 2);
+    shader.uniform("u_Normalmap", 3);
+    shader.uniform("u_Texture", 4);
+    shader.uniform("u_StackSize", static_cast<float>(stack.size));
   }
 
-  float get_terrain_height(glm::vec2 coords) { return 0.0f; }
+  // heights of a level of the stack under the rectangle of world x and z from min to max
+  void bounds(int level, const glm::vec2& min, const glm::vec2& max, float* low, float* high) const
+  {
+    uint16_t lo, hi;
+    stack.bounds(level, min, max, &lo, &hi);
+    *low = height_scale * lo / 65535.0f, *high = height_scale * hi / 65535.0f;
+  }
+
+ private:
+  // the heights of a loaded tile with its border texels repeated once around it. the stack clamps its lookups at the
+  // border of a tile, and with the extra texels the bilinear patches and the pyramid reach all the way to its edges
+  struct CollisionTile {
+    TileKey key;
+    glm::vec2 min, max;  // world x and z covered by the tile
+    collider::Heightmap heights;
+    collider::HeightmapPyramid pyramid;
+
+    CollisionTile(const TileKey& key, const glm::vec2& center, float size, const Image& image)
+        : key(key), min(center - 0.5f * size), max(center + 0.5f * size), heights(pad(image)), pyramid(heights)
+    {
+      heights.center = center;
+      heights.magnification = 0.5f * size * static_cast<float>(heights.width) / static_cast<float>(image.width);
+    }
+
+    static collider::Heightmap pad(const Image& image)
+    {
+      const int width = image.width + 2, height = image.height + 2;
+      std::vector<uint16_t> pixels(std::size_t(width) * height);
+      for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+          int ix = std::clamp(x - 1, 0, image.width - 1), iy = std::clamp(y - 1, 0, image.height - 1);
+          pixels[y * width + x] = image.pixels[(iy * image.width + ix) * image.channels] * 257;
+        }
+      }
+      return collider::Heightmap(pixels.data(), width, height, 1);
+    }
+  };
+
+  std::vector<std::unique_ptr<CollisionTile>> tiles;  // highest zoom first, the pyramids point at the heights
+
+  const CollisionTile* find_tile(const glm::vec2& point) const
+  {
+    for (const auto& tile : tiles) {
+      const glm::vec2 &min = tile->min, &max = tile->max;
+      if (point.x >= min.x && point.y >= min.y && point.x <= max.x && point.y <= max.y) return tile.get();
+    }
+    return nullptr;
+  }
+
+  // first hit along origin + direction * t for t in [0, 1], -1 if there is none. covered collects the ranges of t
+  // over the tiles tested so far, the parts of the segment over a tile that a finer tile covered are skipped and the
+  // parts that no tile covers are tested against sea level
+  float raycast(const glm::vec3& origin, const glm::vec3& direction, float lift, std::vector<glm::vec2>& covered) const
+  {
+    covered.clear();
+    float closest = 1.0f;
+    bool hit = false;
+
+    // calls test(begin, end) for the parts of [t0, t1] before the closest hit that are not covered yet. covered is
+    // sorted by the start of the ranges
+    auto uncovered = [&](float t0, float t1, const auto& test) {
+      float begin = t0;
+      for (const auto& range : covered) {
+        if (range.x >= t1) break;
+        if (range.x > begin && begin < closest) test(begin, std::min(range.x, closest));
+        begin = std::max(begin, range.y);
+      }
+      if (begin < std::min(t1, closest)) test(begin, std::min(t1, closest));
+    };
+
+    for (const auto& tile : tiles) {
+      float t0, t1;
+      if (!clip(origin, direction, tile->min, tile->max, &t0, &t1) || t0 > closest) continue;
+
+      uncovered(t0, t1, [&](float begin, float end) {
+        float t;
+        if (tile->pyramid.raycast(origin + direction * begin, direction, end - begin, &t, lift)) {
+          closest = begin + t, hit = true;
+        }
+      });
+
+      auto later = [t0](const auto& range) { return range.x > t0; };
+      covered.insert(std::find_if(covered.begin(), covered.end(), later), glm::vec2(t0, t1));
+    }
+
+    uncovered(0.0f, 1.0f, [&](float begin, float end) {
+      float above = origin.y + direction.y * begin - lift;
+      float t = (above <= 0.0f) ? begin : (direction.y < 0.0f) ? begin - above / direction.y : end + 1.0f;
+      if (t <= end) closest = t, hit = true;
+    });
+
+    return hit ? closest : -1.0f;
+  }
+
+  // range of t in [0, 1] where origin + direction * t is over the rectangle of world x and z from min to max
+  static bool clip(const glm::vec3& origin, const glm::vec3& direction, const glm::vec2& min, const glm::vec2& max,
+                   float* t0, float* t1)
+  {
+    const glm::vec2 o(origin.x, origin.z), d(direction.x, direction.z);
+    *t0 = 0.0f, *t1 = 1.0f;
+    for (int axis = 0; axis < 2; axis++) {
+      if (d[axis] == 0.0f) {
+        if (o[axis] < min[axis] || o[axis] > max[axis]) return false;
+        continue;
+      }
+      float a = (min[axis] - o[axis]) / d[axis], b = (max[axis] - o[axis]) / d[axis];
+      *t0 = std::max(*t0, std::min(a, b)), *t1 = std::min(*t1, std::max(a, b));
+    }
+    return *t0 <= *t1;
+  }
+};
+
+// level k of the stack has the spacing of the vertices of clipmap level k + 1
+class Clipmap : public Terrain
+{
+ public:
+  Clipmap(TerrainStreamer& streamer, int levels = 16, int segments = 32, float segment_size = 2.0f)
+      : Terrain(streamer, levels, 2.0f * segment_size),
+        shader("shaders/terrain"),
+        layout(levels, segments, segment_size),
+        meshes(layout)
+  {
+  }
+
+  // level selection settings, and the levels and blocks of the last frame
+  ClipmapLayout& get_layout() { return layout; }
+  const ClipmapLayout& get_layout() const { return layout; }
+
+  int get_drawn() const override { return layout.get_drawn(); }
+  int get_culled() const override { return layout.get_culled(); }
+  std::size_t get_memory() const override { return meshes.memory; }
 
   void draw_self(gfx::RenderContext& context) override
   {
 #if 1
     if (!context.is_shadow_pass) {
       auto camera_pos = context.camera->get_world_position();
-      float height = camera_pos.y;
-      auto camera_pos_xy = glm::vec2(camera_pos.x, camera_pos.z);
 
-      heightmap.bind(2);
-      normalmap.bind(3);
-      terrain.bind(4);
+      // the levels depend on the height above the terrain
+      layout.build(camera_pos, get_height_above_ground(camera_pos));
+      update_stack(camera_pos, layout.get_min_level() - 1, layout.get_max_level() - 1);
 
       shader.bind();
-      shader.uniform("u_Heightmap", 2);
-      shader.uniform("u_Normalmap", 3);
-      shader.uniform("u_Texture", 4);
+      bind_textures(shader);
       shader.uniform("u_Background", context.background_color);
-      shader.uniform("u_View", context.camera->get_view_matrix());
-      shader.uniform("u_CameraPos", context.camera->get_world_position());
-      shader.uniform("u_Projection", context.camera->get_projection_matrix());
-      shader.uniform("u_TerrainSize", terrain_size);
+      shader.uniform("u_SegmentSize", layout.segment_size);
+      shader.uniform("u_Segments", static_cast<float>(layout.segments));
 
       glEnable(GL_CULL_FACE);
       glEnable(GL_PRIMITIVE_RESTART);
       glPrimitiveRestartIndex(primitive_restart);
       if (wireframe) glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 
-      int min_level = 1;  // should depend on camera height
-
-      for (int l = min_level; l <= levels; l++) {
-        const int rows = 5, cols = 5;
-        // float border = 0.0f;
-        float scale = std::pow(2.0f, l);
-        float next_scale = std::pow(2.0f, l + 2);
-        float scaled_segment_size = segment_size * scale;
-        float tile_size = segments * scaled_segment_size;
-        glm::vec2 snapped = glm::floor(camera_pos_xy / next_scale) * next_scale;
-        auto base = calc_base(l, camera_pos_xy);
-
-        shader.uniform("u_Scale", scale);
-        shader.uniform("u_SegmentSize", scaled_segment_size);
-        shader.uniform("u_Level", static_cast<float>(l) / levels);
-
-#if 1
-        // don't render lots of detail if we are very high up
-        if (tile_size * 5 < height * 2.5) {
-          min_level = l + 1;
-          continue;
-        }
-#endif
-#if 1
-        if (l == min_level) {
-          shader.uniform("u_Model", transform_matrix(base + glm::vec2(tile_size, tile_size), scale));
-          center.draw();
-        } else {
-          auto prev_base = calc_base(l - 1, camera_pos_xy);
-          auto diff = glm::abs(base - prev_base);
-
-          auto l_offset = glm::vec2(tile_size, tile_size);
-          if (diff.x == tile_size) {
-            l_offset.x += (2 * segments + 1) * scaled_segment_size;
-          }
-          shader.uniform("u_Model", transform_matrix(base + l_offset, scale));
-          horizontal.draw();
+      // one draw per kind of block for all levels, blocks are culled against the heights of their level in the stack
+      auto level_bounds = [this](int level, const glm::vec2& min, const glm::vec2& max, float* low, float* high) {
+        bounds(level - 1, min, max, low, high);
+      };
+      layout.cull(collider::Frustum(context.camera->get_projection_matrix() * context.camera->get_view_matrix()),
+                  level_bounds);
+      shader.uniform("u_MinScale", std::exp2(static_cast<float>(layout.get_min_level())));
+      shader.uniform("u_MinMorph", layout.get_min_morph());
 
-          auto v_offset = glm::vec2(tile_size, tile_size);
-          if (diff.y == tile_size) {
-            v_offset.y += (2 * segments + 1) * scaled_segment_size;
-          }
-
-          shader.uniform("u_Model", transform_matrix(base + v_offset, scale));
-          vertical.draw();
-        }
-#endif
-
-        glm::vec2 offset(0.0f);
-        for (int r = 0; r < rows; r++) {
-          offset.y = 0;
-          for (int c = 0; c < cols; c++) {
-            if (r == 0 || r == rows - 1 || c == 0 || c == cols - 1) {
-              auto tile_pos = base + offset;
-              shader.uniform("u_Model", transform_matrix(tile_pos, scale));
-
-              if ((c != 2) && (r != 2)) {
-                if (c == 0 && r == 0)  // east
-                {
-                  shader.uniform("u_Model", transform_matrix(tile_pos, scale));
-                  seam.draw();
-                } else if (c == cols - 1 && r == rows - 1)  // west
-                {
-                  shader.uniform("u_Model", transform_matrix(tile_pos + glm::vec2(tile_size), scale, 180.0f));
-                  seam.draw();
-                } else if (c == cols - 1 && r == 0)  // south
-                {
-                  shader.uniform("u_Model", transform_matrix(tile_pos + glm::vec2(0, tile_size), scale, 90.0f));
-                  seam.draw();
-                } else if (c == 0 && r == rows - 1)  // north
-                {
-                  shader.uniform("u_Model", transform_matrix(tile_pos + glm::vec2(tile_size, 0), scale, -90.0f));
-                  seam.draw();
-                }
-
-                shader.uniform("u_Model", transform_matrix(tile_pos, scale));
-                tile.draw();
-              } else if (c == 2) {
-                col_fixup.draw();
-              } else if (r == 2) {
-                row_fixup.draw();
-              }
-            }
-
-            if (c == 2) {
-              offset.y += 2 * scaled_segment_size;
-            } else {
-              offset.y += tile_size;
-            }
-          }
-
-          if (r == 2) {
-            offset.x += 2 * scaled_segment_size;
-          } else {
-            offset.x += tile_size;
-          }
-        }
-      }
+      meshes.draw(layout);
 
       if (wireframe) glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 
@@ -283,39 +532,67 @@ class Clipmap : public gfx::Object3D
 
  private:
   gfx::gl::Shader shader;
-  gfx::gl::Texture heightmap;
-  gfx::gl::Texture normalmap;
-  gfx::gl::Texture terrain;
-
-  Block tile;
-  Block center;
-  Block col_fixup;
-  Block row_fixup;
-  Block horizontal;
-  Block vertical;
-  Seam seam;
-
-  unsigned index_count = 0;
-  const int levels;
-  const int segments;
-  const float terrain_size;  // width and length of the terrain represented by the heightmap
-  const float segment_size;
-
-  glm::vec2 calc_base(int level, glm::vec2 camera_pos)
+  ClipmapLayout layout;
+  ClipmapMeshes meshes;
+};
+
+// lod k of the quadtree samples level k of the stack, which has the spacing of its vertices
+class CdlodTerrain : public Terrain
+{
+ public:
+  CdlodTerrain(TerrainStreamer& streamer, int lods = 16, int grid = 16, float spacing = 4.0f)
+      : Terrain(streamer, lods, spacing),
+        shader(load_text_file("shaders/cdlod.vert"), load_text_file("shaders/terrain.frag")),
+        quadtree(lods, grid, spacing),
+        mesh(grid)
   {
-    float scale = std::pow(2.0f, level);
-    float next_scale = std::pow(2.0f, level + 2);
-    float tile_size = segments * segment_size * scale;
-    glm::vec2 snapped = glm::floor(camera_pos / next_scale) * next_scale;
-    glm::vec2 base = snapped - tile_size * 2.0f;
-    return base;
   }
 
-  glm::mat4 transform_matrix(const glm::vec2& position, float scale, float angle = 0)
+  // lod settings, and the nodes of the last frame
+  CdlodQuadtree& get_quadtree() { return quadtree; }
+  const CdlodQuadtree& get_quadtree() const { return quadtree; }
+
+  int get_drawn() const override { return quadtree.get_drawn(); }
+  int get_culled() const override { return quadtree.get_culled(); }
+  std::size_t get_memory() const override { return mesh.memory; }
+
+  void draw_self(gfx::RenderContext& context) override
   {
-    auto S = glm::scale(glm::mat4(1.0f), glm::vec3(scale));
-    auto T = glm::translate(glm::mat4(1.0f), glm::vec3(position.x, 0.0f, position.y));
-    auto R = glm::rotate(glm::mat4(1.0f), glm::radians(angle), glm::vec3(0.0f, 1.0f, 0.0f));
-    return T * R * S;
+    if (context.is_shadow_pass) return;
+
+    auto camera_pos = context.camera->get_world_position();
+
+    // the stack is updated before the selection, which culls against its heights. the lods above the roots are
+    // never selected, so their layers are left empty
+    update_stack(camera_pos, 0, quadtree.get_coarsest_lod());
+    auto lod_bounds = [this](int lod, const glm::vec2& min, const glm::vec2& max, float* low, float* high) {
+      bounds(lod, min, max, low, high);
+    };
+    quadtree.select(camera_pos,
+                    collider::Frustum(context.camera->get_projection_matrix() * context.camera->get_view_matrix()),
+                    lod_bounds);
+
+    shader.bind();
+    bind_textures(shader);
+    shader.uniform("u_Background", context.background_color);
+    shader.uniform("u_Grid", static_cast<float>(quadtree.grid));
+    std::array<glm::vec2, 16> morph{};  // u_Morph in the shader
+    for (int lod = 0; lod <= std::min(quadtree.get_max_lod(), 15); lod++) morph[lod] = quadtree.get_morph(lod);
+    shader.uniform("u_Morph", morph.data(), static_cast<int>(morph.size()));
+
+    glEnable(GL_CULL_FACE);
+    if (wireframe) glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+
+    mesh.draw(quadtree);
+
+    if (wireframe) glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+    glDisable(GL_CULL_FACE);
+
+    shader.unbind();
   }
-};
\ No newline at end of file
+
+ private:
+  gfx::gl::Shader shader;
+  CdlodQuadtree quadtree;
+  CdlodMesh mesh;
+};
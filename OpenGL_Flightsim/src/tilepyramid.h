@@ -0,0 +1,184 @@
+/*
+    memory mapped terrain tile pyramid written by tools/terrain_pyramid.cpp
+*/
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// the file is a header, the index sorted by zoom, x and y, and the data of the tiles. every tile has a full mip chain
+// of heights (uint16), normals (rgba8, n * 0.5 + 0.5) and imagery (rgba8), level 0 is size x size texels and every
+// level is stored right after the one above it, rows from top to bottom. the data is ready for glTexImage2D and for
+// collider::Heightmap, nothing has to be decoded when the file is opened
+namespace tilepyramid
+{
+constexpr char MAGIC[8] = {'P', 'H', 'I', 'T', 'I', 'L', 'E', 'S'};
+constexpr uint32_t VERSION = 1;
+constexpr uint64_t ALIGNMENT = 64;  // of every tile section in the file
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t tile_count;
+  uint32_t size;    // texels along one side of level 0
+  uint32_t levels;  // mip levels of every tile, the last one is 1 x 1
+  uint64_t index_offset;
+};
+
+struct Entry {
+  int32_t zoom, x, y;
+  float width;                       // of the tile in meters
+  float height_scale, height_shift;  // height = height_scale * value / 65535 + height_shift, like collider::Heightmap
+  float min_height, max_height;      // m
+  uint64_t heights, normals, texture;  // file offsets of level 0
+};
+
+static_assert(sizeof(Header) == 32 && sizeof(Entry) == 56, "the layout is part of the file format");
+
+// texels of a level
+inline uint64_t texels(uint32_t size, uint32_t level)
+{
+  uint64_t s = std::max<uint64_t>(size >> level, 1);
+  return s * s;
+}
+
+// offset of a level from level 0, in texels
+inline uint64_t level_offset(uint32_t size, uint32_t level)
+{
+  uint64_t offset = 0;
+  for (uint32_t i = 0; i < level; i++) offset += texels(size, i);
+  return offset;
+}
+
+inline uint64_t align(uint64_t offset) { return (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT; }
+
+inline bool operator<(const Entry& a, const Entry& b)
+{
+  if (a.zoom != b.zoom) return a.zoom < b.zoom;
+  if (a.x != b.x) return a.x < b.x;
+  return a.y < b.y;
+}
+
+// read only view of a pyramid file, the pointers stay valid as long as the file is open
+class File
+{
+ public:
+  File() = default;
+  File(const std::string& path) { open(path); }
+  File(const File&) = delete;
+  File& operator=(const File&) = delete;
+  ~File() { close(); }
+
+  // maps the file, returns false if it is missing or not a pyramid file
+  bool open(const std::string& path)
+  {
+    close();
+#ifdef _WIN32
+    file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                       nullptr);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER file_size;
+    GetFileSizeEx(file, &file_size);
+    length = static_cast<std::size_t>(file_size.QuadPart);
+    mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping != nullptr) data = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      length = static_cast<std::size_t>(st.st_size);
+      void* mapped = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+      if (mapped != MAP_FAILED) data = static_cast<const uint8_t*>(mapped);
+    }
+    ::close(fd);
+#endif
+    if (data == nullptr || !valid()) {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  void close()
+  {
+#ifdef _WIN32
+    if (data != nullptr) UnmapViewOfFile(data);
+    if (mapping != nullptr) CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+    mapping = nullptr, file = INVALID_HANDLE_VALUE;
+#else
+    if (data != nullptr) munmap(const_cast<uint8_t*>(data), length);
+#endif
+    data = nullptr, length = 0;
+  }
+
+  bool is_open() const { return data != nullptr; }
+
+  const Header& header() const { return *reinterpret_cast<const Header*>(data); }
+
+  const Entry* begin() const { return reinterpret_cast<const Entry*>(data + header().index_offset); }
+
+  const Entry* end() const { return begin() + header().tile_count; }
+
+  // binary search in the index, nullptr if the tile is not in the file
+  const Entry* find(int zoom, int x, int y) const
+  {
+    // only the tile coordinates are compared
+    Entry key{};
+    key.zoom = zoom;
+    key.x = x;
+    key.y = y;
+    auto it = std::lower_bound(begin(), end(), key);
+    return (it != end() && it->zoom == zoom && it->x == x && it->y == y) ? it : nullptr;
+  }
+
+  // size x size of a level
+  uint32_t size(uint32_t level) const { return std::max(header().size >> level, 1u); }
+
+  const uint16_t* heights(const Entry& entry, uint32_t level = 0) const
+  {
+    return reinterpret_cast<const uint16_t*>(data + entry.heights) + level_offset(header().size, level);
+  }
+
+  const uint8_t* normals(const Entry& entry, uint32_t level = 0) const
+  {
+    return data + entry.normals + 4 * level_offset(header().size, level);
+  }
+
+  const uint8_t* texture(const Entry& entry, uint32_t level = 0) const
+  {
+    return data + entry.texture + 4 * level_offset(header().size, level);
+  }
+
+ private:
+  const uint8_t* data = nullptr;
+  std::size_t length = 0;
+#ifdef _WIN32
+  HANDLE file = INVALID_HANDLE_VALUE;
+  HANDLE mapping = nullptr;
+#endif
+
+  // the header and the index must be inside the file, the tile data is trusted
+  bool valid() const
+  {
+    if (length < sizeof(Header)) return false;
+    const auto& h = header();
+    if (std::memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.version != VERSION) return false;
+    return h.index_offset + uint64_t(h.tile_count) * sizeof(Entry) <= length;
+  }
+};
+}  // namespace tilepyramid
@@ -0,0 +1,266 @@
+/*
+    autotuner for the rate controllers, runs headless step response simulations on all cores and searches the gains
+    with nelder-mead. prints a gain table per flight condition as csv
+
+    usage: autotune [iterations]
+*/
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "../src/flightmodel.h"
+#include "../src/pid.h"
+
+constexpr float CONTROL_RATE = 120.0f;  // same as the flight control bank in main.cpp
+constexpr phi::Seconds DT = 1.0f / CONTROL_RATE;
+
+// same airframe as FLIGHTMODEL == FAST_JET in main.cpp
+struct FastJet {
+  const float mass = 10000.0f;
+  const float thrust = 75000.0f;
+  const float wing_offset = -1.0f;
+  const float tail_offset = -6.6f;
+
+  const Airfoil NACA_0012{NACA_0012_data};
+  const Airfoil NACA_2412{NACA_2412_data};
+
+  Airplane create(Engine* engine) const
+  {
+    std::vector<phi::inertia::Element> masses = {
+        phi::inertia::cube({wing_offset, 0.0f, -2.7f}, {6.96f, 0.10f, 3.50f}, mass * 0.25f),  // left wing
+        phi::inertia::cube({wing_offset, 0.0f, +2.7f}, {6.96f, 0.10f, 3.50f}, mass * 0.25f),  // right wing
+        phi::inertia::cube({tail_offset, -0.1f, 0.0f}, {6.54f, 0.10f, 2.70f}, mass * 0.1f),   // elevator
+        phi::inertia::cube({tail_offset, 0.0f, 0.0f}, {5.31f, 3.10f, 0.10f}, mass * 0.1f),    // rudder
+        phi::inertia::cube({0.0f, 0.0f, 0.0f}, {8.0f, 2.0f, 2.0f}, mass * 0.5f),              // fuselage
+    };
+
+    std::vector<Wing> wings = {
+        Wing({wing_offset, 0.0f, -2.7f}, 6.96f, 2.50f, &NACA_2412, phi::UP, 0.20f),    // left wing
+        Wing({wing_offset, 0.0f, +2.7f}, 6.96f, 2.50f, &NACA_2412, phi::UP, 0.20f),    // right wing
+        Wing({tail_offset, -0.1f, 0.0f}, 6.54f, 2.70f, &NACA_0012, phi::UP, 1.0f),     // elevator
+        Wing({tail_offset, 0.0f, 0.0f}, 5.31f, 3.10f, &NACA_0012, phi::RIGHT, 0.15f),  // rudder
+    };
+
+    return Airplane(mass, phi::inertia::tensor(masses, true), wings, {engine}, nullptr);
+  }
+};
+
+struct Condition {
+  float speed;     // m/s
+  float altitude;  // m
+};
+
+// a rate loop maps a target angular velocity in deg/s to one axis of the joystick
+struct Loop {
+  const char* name;
+  int axis;      // joystick and angular velocity component
+  float target;  // size of the step, deg/s
+};
+
+const Loop loops[] = {
+    {"roll_rate", 0, 90.0f},
+    {"pitch_rate", 2, 20.0f},
+};
+
+const Condition conditions[] = {
+    {150.0f, 1000.0f}, {250.0f, 1000.0f}, {350.0f, 1000.0f},  //
+    {150.0f, 5000.0f}, {250.0f, 5000.0f}, {350.0f, 5000.0f},  //
+    {200.0f, 9000.0f}, {300.0f, 9000.0f}, {400.0f, 9000.0f},  //
+};
+
+using Gains = std::array<float, 3>;  // kp, ki, kd
+
+// starting points of the search, log10 of the gains
+const Gains starts[] = {
+    {0.0f, -3.0f, -3.0f},
+    {-1.0f, 0.0f, -3.0f},
+    {-1.5f, -1.0f, -2.0f},
+    {-0.5f, -2.0f, -1.0f},
+};
+
+constexpr float FAILED = 1e6f;
+
+// cost of a step response, lower is better. weighs tracking error, overshoot, settling time and control effort
+float simulate(const FastJet& jet, const Condition& condition, const Loop& loop, const Gains& gains, float step)
+{
+  constexpr phi::Seconds HOLD = 0.5f, DURATION = 3.0f;
+
+  SimpleEngine engine(jet.thrust);
+  Airplane airplane = jet.create(&engine);
+  airplane.position = glm::vec3(0.0f, condition.altitude, 0.0f);
+  airplane.velocity = glm::vec3(condition.speed, 0.0f, 0.0f);
+  airplane.throttle = 0.5f;
+
+  PIDBank bank(CONTROL_RATE);
+  int pid = bank.add(gains[0], gains[1], gains[2]);
+
+  float error_integral = 0.0f, peak = 0.0f, settling_time = 0.0f, effort = 0.0f, previous_output = 0.0f;
+  float target = step * loop.target;
+
+  for (phi::Seconds t = 0.0f; t < HOLD + DURATION; t += DT) {
+    float current = glm::degrees(airplane.angular_velocity[loop.axis]);
+    float setpoint = (t < HOLD) ? 0.0f : target;
+
+    bank.set(pid, current, setpoint);
+    bank.step();
+    float output = bank.get(pid);
+    airplane.joystick[loop.axis] = output;
+    airplane.update(DT);
+
+    // isa is only valid up to 11 km
+    if (!std::isfinite(current) || airplane.position.y < 100.0f || airplane.position.y > 10900.0f) return FAILED;
+
+    if (t >= HOLD) {
+      float error = std::abs(setpoint - current);
+      error_integral += error * DT;
+      peak = std::max(peak, current * step);
+      if (error > 0.05f * std::abs(target)) settling_time = t - HOLD;
+    }
+    effort += std::abs(output - previous_output);
+    previous_output = output;
+  }
+
+  float overshoot = std::max(0.0f, peak - std::abs(target)) / std::abs(target);
+  float iae = error_integral / (std::abs(target) * DURATION);
+  return iae + 2.0f * overshoot + settling_time / DURATION + 0.01f * effort;
+}
+
+// a positive and a negative step, so asymmetric responses are penalized too
+float evaluate(const FastJet& jet, const Condition& condition, const Loop& loop, const Gains& log_gains)
+{
+  Gains gains;
+  for (int i = 0; i < 3; i++) gains[i] = std::pow(10.0f, log_gains[i]);
+  return simulate(jet, condition, loop, gains, 1.0f) + simulate(jet, condition, loop, gains, -1.0f);
+}
+
+// nelder-mead in log10 gain space
+template <typename F>
+Gains minimize(F cost, const Gains& start, int iterations, float* best_cost)
+{
+  constexpr int N = 3;
+  std::array<Gains, N + 1> simplex;
+  std::array<float, N + 1> costs;
+
+  simplex[0] = start;
+  for (int i = 0; i < N; i++) {
+    simplex[i + 1] = simplex[0];
+    simplex[i + 1][i] += 1.0f;
+  }
+  for (int i = 0; i <= N; i++) costs[i] = cost(simplex[i]);
+
+  auto combine = [](const Gains& a, const Gains& b, float t) {
+    Gains result;
+    for (int i = 0; i < N; i++) result[i] = a[i] + (b[i] - a[i]) * t;
+    return result;
+  };
+
+  for (int iteration = 0; iteration < iterations; iteration++) {
+    std::array<int, N + 1> order = {0, 1, 2, 3};
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return costs[a] < costs[b]; });
+    int best = order[0], worst = order[N], second_worst = order[N - 1];
+
+    Gains centroid{};
+    for (int i = 0; i < N; i++) {
+      for (int j = 0; j < N; j++) centroid[j] += simplex[order[i]][j] / N;
+    }
+
+    auto reflected = combine(centroid, simplex[worst], -1.0f);
+    float reflected_cost = cost(reflected);
+
+    if (reflected_cost < costs[best]) {
+      auto expanded = combine(centroid, simplex[worst], -2.0f);
+      float expanded_cost = cost(expanded);
+      bool expand = expanded_cost < reflected_cost;
+      simplex[worst] = expand ? expanded : reflected;
+      costs[worst] = expand ? expanded_cost : reflected_cost;
+    } else if (reflected_cost < costs[second_worst]) {
+      simplex[worst] = reflected, costs[worst] = reflected_cost;
+    } else {
+      auto contracted = combine(centroid, simplex[worst], 0.5f);
+      float contracted_cost = cost(contracted);
+      if (contracted_cost < costs[worst]) {
+        simplex[worst] = contracted, costs[worst] = contracted_cost;
+      } else {
+        // shrink towards the best point
+        for (int i = 0; i <= N; i++) {
+          if (i == best) continue;
+          simplex[i] = combine(simplex[best], simplex[i], 0.5f);
+          costs[i] = cost(simplex[i]);
+        }
+      }
+    }
+  }
+
+  int best = static_cast<int>(std::min_element(costs.begin(), costs.end()) - costs.begin());
+  *best_cost = costs[best];
+  return simplex[best];
+}
+
+struct Result {
+  Gains gains;
+  float cost;
+};
+
+int main(int argc, char* argv[])
+{
+  int iterations = (argc > 1) ? std::atoi(argv[1]) : 60;
+
+  const FastJet jet;
+  constexpr int NUM_LOOPS = sizeof(loops) / sizeof(loops[0]);
+  constexpr int NUM_CONDITIONS = sizeof(conditions) / sizeof(conditions[0]);
+  constexpr int NUM_TASKS = NUM_LOOPS * NUM_CONDITIONS;
+
+  // every flight condition and loop is tuned independently, workers take the next task until all are done
+  std::vector<Result> results(NUM_TASKS);
+  std::atomic<int> next_task = 0, finished = 0;
+
+  auto worker = [&]() {
+    for (int task; (task = next_task++) < NUM_TASKS;) {
+      const auto& condition = conditions[task / NUM_LOOPS];
+      const auto& loop = loops[task % NUM_LOOPS];
+
+      auto cost = [&](const Gains& log_gains) { return evaluate(jet, condition, loop, log_gains); };
+      auto& result = results[task];
+      result.cost = FAILED;
+
+      // the cost has local minima, so the search is restarted from a few points, the first being the hand picked
+      // gains used in main.cpp
+      for (const auto& start : starts) {
+        float cost_found;
+        auto log_gains = minimize(cost, start, iterations, &cost_found);
+        if (cost_found < result.cost) {
+          result.cost = cost_found;
+          for (int i = 0; i < 3; i++) result.gains[i] = std::pow(10.0f, log_gains[i]);
+        }
+      }
+
+      fprintf(stderr, "%d/%d\r", ++finished, NUM_TASKS);
+    }
+  };
+
+  int num_threads = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_threads; i++) threads.emplace_back(worker);
+  for (auto& thread : threads) thread.join();
+
+  // a task where every start failed has no gains, it is left out of the table
+  printf("loop,speed,altitude,kp,ki,kd,cost\n");
+  for (int task = 0; task < NUM_TASKS; task++) {
+    const auto& condition = conditions[task / NUM_LOOPS];
+    const auto& result = results[task];
+    if (result.cost >= FAILED) {
+      fprintf(stderr, "%s at %.0f m/s and %.0f m: no gains found\n", loops[task % NUM_LOOPS].name, condition.speed,
+              condition.altitude);
+      continue;
+    }
+    printf("%s,%.0f,%.0f,%.4f,%.4f,%.4f,%.3f\n", loops[task % NUM_LOOPS].name, condition.speed, condition.altitude,
+           result.gains[0], result.gains[1], result.gains[2], result.cost);
+  }
+
+  return 0;
+}
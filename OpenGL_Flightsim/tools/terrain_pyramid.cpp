@@ -0,0 +1,289 @@
+/*
+    converts downloaded terrarium elevation tiles and imagery tiles into one memory mapped tile pyramid, see
+    src/tilepyramid.h. elevations keep their full precision, every tile gets its own 16 bit height range. normals and
+    mip levels are generated on all cores
+
+    usage: terrain_pyramid <input directory> <output file> [merge] [threads]
+
+    the input directory has the layout of tools/terrain/create_map.sh, height/tile_{zoom}_{x}_{y}.png with terrarium
+    tiles and optionally texture/tile_{zoom}_{x}_{y}.png or .jpg with imagery. 2^merge x 2^merge input tiles are
+    combined into one output tile at zoom - merge, the default of 2 gives the 4 x 4 tiles of create_map.sh
+*/
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <glm/glm.hpp>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "../lib/stb_image.h"
+#include "../src/tilepyramid.h"
+
+namespace fs = std::filesystem;
+using tilepyramid::Entry;
+
+constexpr double EARTH_CIRCUMFERENCE = 40075016.686;  // equator of the geoid used by openstreetmap, m
+constexpr double PI = 3.14159265358979323846;
+
+struct Source {
+  int x, y;  // position inside the output tile, in input tiles
+  std::string height, texture;
+};
+
+struct Tile {
+  Entry entry;
+  std::vector<Source> sources;
+};
+
+// terrarium encodes the elevation as (r * 256 + g + b / 256) - 32768 meters
+float decode_terrarium(const uint8_t* rgb) { return (rgb[0] * 256.0f + rgb[1] + rgb[2] / 256.0f) - 32768.0f; }
+
+// width in meters of a web mercator tile, measured at its center
+float tile_width(int zoom, int y)
+{
+  double n = std::exp2(zoom);
+  double latitude = std::atan(std::sinh(PI * (1.0 - 2.0 * (y + 0.5) / n)));
+  return static_cast<float>(EARTH_CIRCUMFERENCE * std::cos(latitude) / n);
+}
+
+// box filter of a size x size level into the level below it
+template <typename T, typename F>
+void downsample(const T* src, T* dst, int size, int components, F average)
+{
+  int half = std::max(size / 2, 1);
+  for (int y = 0; y < half; y++) {
+    for (int x = 0; x < half; x++) {
+      int x0 = std::min(2 * x, size - 1), x1 = std::min(2 * x + 1, size - 1);
+      int y0 = std::min(2 * y, size - 1), y1 = std::min(2 * y + 1, size - 1);
+      for (int c = 0; c < components; c++) {
+        dst[(y * half + x) * components + c] =
+            average(src[(y0 * size + x0) * components + c], src[(y0 * size + x1) * components + c],
+                    src[(y1 * size + x0) * components + c], src[(y1 * size + x1) * components + c]);
+      }
+    }
+  }
+}
+
+// decodes, filters and writes one output tile to its place in the file
+void process(Tile& tile, int source_size, uint32_t size, uint32_t levels, std::fstream& out)
+{
+  std::vector<float> heights(size * size, 0.0f);
+  std::vector<uint8_t> texture(size * size * 4, 0);
+  for (std::size_t i = 3; i < texture.size(); i += 4) texture[i] = 255;
+
+  for (const auto& source : tile.sources) {
+    int w, h, channels;
+    if (uint8_t* pixels = stbi_load(source.height.c_str(), &w, &h, &channels, 3)) {
+      if (w == source_size && h == source_size) {
+        for (int y = 0; y < h; y++) {
+          for (int x = 0; x < w; x++) {
+            int i = (source.y * source_size + y) * size + source.x * source_size + x;
+            heights[i] = decode_terrarium(&pixels[(y * w + x) * 3]);
+          }
+        }
+      } else {
+        fprintf(stderr, "%s: expected %d x %d pixels\n", source.height.c_str(), source_size, source_size);
+      }
+      stbi_image_free(pixels);
+    }
+
+    // imagery can have a different resolution than the elevations
+    if (source.texture.empty()) continue;
+    if (uint8_t* pixels = stbi_load(source.texture.c_str(), &w, &h, &channels, 4)) {
+      for (int y = 0; y < source_size; y++) {
+        for (int x = 0; x < source_size; x++) {
+          int sx = x * w / source_size, sy = y * h / source_size;
+          int i = (source.y * source_size + y) * size + source.x * source_size + x;
+          std::copy_n(&pixels[(sy * w + sx) * 4], 4, &texture[i * 4]);
+        }
+      }
+      stbi_image_free(pixels);
+    }
+  }
+
+  auto& entry = tile.entry;
+  auto [min, max] = std::minmax_element(heights.begin(), heights.end());
+  entry.min_height = *min, entry.max_height = *max;
+  entry.height_shift = entry.min_height;
+  entry.height_scale = std::max(entry.max_height - entry.min_height, 1.0f);
+
+  // normals from central differences, x of the image is x in the world and y of the image is z
+  const float spacing = entry.width / size;
+  const int last = static_cast<int>(size) - 1;
+  std::vector<uint8_t> normals(size * size * 4);
+  for (int y = 0; y <= last; y++) {
+    for (int x = 0; x <= last; x++) {
+      int x0 = std::max(x - 1, 0), x1 = std::min(x + 1, last);
+      int y0 = std::max(y - 1, 0), y1 = std::min(y + 1, last);
+      float dx = (heights[y * size + x1] - heights[y * size + x0]) / ((x1 - x0) * spacing);
+      float dz = (heights[y1 * size + x] - heights[y0 * size + x]) / ((y1 - y0) * spacing);
+      glm::vec3 n = glm::normalize(glm::vec3(-dx, 1.0f, -dz)) * 0.5f + 0.5f;
+      uint8_t* texel = &normals[(y * size + x) * 4];
+      texel[0] = static_cast<uint8_t>(n.x * 255.0f + 0.5f);
+      texel[1] = static_cast<uint8_t>(n.y * 255.0f + 0.5f);
+      texel[2] = static_cast<uint8_t>(n.z * 255.0f + 0.5f);
+      texel[3] = 255;
+    }
+  }
+
+  auto average_float = [](float a, float b, float c, float d) { return 0.25f * (a + b + c + d); };
+  auto average_byte = [](uint8_t a, uint8_t b, uint8_t c, uint8_t d) {
+    return static_cast<uint8_t>((a + b + c + d + 2) / 4);
+  };
+  const float to_value = 65535.0f / entry.height_scale;
+  std::vector<uint16_t> quantized;
+
+  for (uint32_t level = 0; level < levels; level++) {
+    uint32_t level_size = std::max(size >> level, 1u);
+    uint64_t count = tilepyramid::texels(size, level);
+
+    if (level > 0) {
+      std::vector<float> h(count);
+      std::vector<uint8_t> n(count * 4), t(count * 4);
+      downsample(heights.data(), h.data(), level_size * 2, 1, average_float);
+      downsample(normals.data(), n.data(), level_size * 2, 4, average_byte);
+      downsample(texture.data(), t.data(), level_size * 2, 4, average_byte);
+      heights = std::move(h), normals = std::move(n), texture = std::move(t);
+    }
+
+    quantized.resize(count);
+    for (uint64_t i = 0; i < count; i++) {
+      float value = (heights[i] - entry.height_shift) * to_value;
+      quantized[i] = static_cast<uint16_t>(std::clamp(value + 0.5f, 0.0f, 65535.0f));
+    }
+
+    uint64_t offset = tilepyramid::level_offset(size, level);
+    out.seekp(entry.heights + 2 * offset);
+    out.write(reinterpret_cast<const char*>(quantized.data()), count * 2);
+    out.seekp(entry.normals + 4 * offset);
+    out.write(reinterpret_cast<const char*>(normals.data()), count * 4);
+    out.seekp(entry.texture + 4 * offset);
+    out.write(reinterpret_cast<const char*>(texture.data()), count * 4);
+  }
+}
+
+// finds tile_{zoom}_{x}_{y} files in a directory, keyed by zoom, x and y
+std::map<std::array<int, 3>, std::string> scan(const fs::path& directory)
+{
+  std::map<std::array<int, 3>, std::string> files;
+  std::error_code error;
+  for (const auto& file : fs::directory_iterator(directory, error)) {
+    int zoom, x, y;
+    if (std::sscanf(file.path().stem().string().c_str(), "tile_%d_%d_%d", &zoom, &x, &y) == 3) {
+      files[{zoom, x, y}] = file.path().string();
+    }
+  }
+  return files;
+}
+
+int main(int argc, char* argv[])
+{
+  if (argc < 3) {
+    fprintf(stderr, "usage: terrain_pyramid <input directory> <output file> [merge] [threads]\n");
+    return 1;
+  }
+  const fs::path input = argv[1];
+  const std::string output = argv[2];
+  const int merge = (argc > 3) ? std::atoi(argv[3]) : 2;
+  const int num_threads = (argc > 4) ? std::atoi(argv[4]) : std::max(1u, std::thread::hardware_concurrency());
+
+  auto start = std::chrono::steady_clock::now();
+
+  auto height_files = scan(input / "height");
+  auto texture_files = scan(input / "texture");
+  if (height_files.empty()) {
+    fprintf(stderr, "no height/tile_{zoom}_{x}_{y}.png in %s\n", input.string().c_str());
+    return 1;
+  }
+
+  int source_size, h, channels;
+  if (!stbi_info(height_files.begin()->second.c_str(), &source_size, &h, &channels)) {
+    fprintf(stderr, "%s: %s\n", height_files.begin()->second.c_str(), stbi_failure_reason());
+    return 1;
+  }
+
+  // group the input tiles by the output tile that contains them
+  std::map<std::array<int, 3>, Tile> grouped;
+  for (const auto& [key, path] : height_files) {
+    auto [zoom, x, y] = key;
+    auto& tile = grouped[{zoom - merge, x >> merge, y >> merge}];
+    tile.entry.zoom = zoom - merge, tile.entry.x = x >> merge, tile.entry.y = y >> merge;
+    auto texture = texture_files.find(key);
+    tile.sources.push_back({x - (tile.entry.x << merge), y - (tile.entry.y << merge), path,
+                            texture != texture_files.end() ? texture->second : ""});
+  }
+
+  const uint32_t size = static_cast<uint32_t>(source_size) << merge;
+  const uint32_t levels = std::bit_width(size);
+  const uint64_t level_texels = tilepyramid::level_offset(size, levels);
+
+  // the layout is known up front, so the workers write their tiles in place
+  std::vector<Tile> tiles;
+  for (auto& [key, tile] : grouped) tiles.push_back(std::move(tile));
+
+  tilepyramid::Header header{.magic = {},
+                             .version = tilepyramid::VERSION,
+                             .tile_count = static_cast<uint32_t>(tiles.size()),
+                             .size = size,
+                             .levels = levels,
+                             .index_offset = tilepyramid::align(sizeof(tilepyramid::Header))};
+  std::copy_n(tilepyramid::MAGIC, sizeof(header.magic), header.magic);
+
+  uint64_t offset = tilepyramid::align(header.index_offset + tiles.size() * sizeof(Entry));
+  for (auto& tile : tiles) {
+    tile.entry.width = tile_width(tile.entry.zoom, tile.entry.y);
+    tile.entry.heights = offset;
+    tile.entry.normals = offset = tilepyramid::align(offset + 2 * level_texels);
+    tile.entry.texture = offset = tilepyramid::align(offset + 4 * level_texels);
+    offset = tilepyramid::align(offset + 4 * level_texels);
+  }
+
+  {
+    std::ofstream out(output, std::ios::binary | std::ios::trunc);
+    if (!out) {
+      fprintf(stderr, "can't write %s\n", output.c_str());
+      return 1;
+    }
+    // the index is written again once the height ranges are known
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.seekp(offset - 1);
+    out.put(0);
+  }
+
+  std::atomic<int> next = 0, finished = 0;
+  auto worker = [&]() {
+    std::fstream out(output, std::ios::binary | std::ios::in | std::ios::out);
+    for (int i = next++; i < static_cast<int>(tiles.size()); i = next++) {
+      process(tiles[i], source_size, size, levels, out);
+      fprintf(stderr, "%d/%d\r", ++finished, static_cast<int>(tiles.size()));
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < std::max(num_threads, 1); i++) threads.emplace_back(worker);
+  for (auto& thread : threads) thread.join();
+
+  std::fstream out(output, std::ios::binary | std::ios::in | std::ios::out);
+  out.seekp(header.index_offset);
+  for (const auto& tile : tiles) out.write(reinterpret_cast<const char*>(&tile.entry), sizeof(Entry));
+  if (!out) {
+    fprintf(stderr, "can't write %s\n", output.c_str());
+    return 1;
+  }
+
+  fprintf(stderr, "\n");
+  float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count();
+  printf("%zu tiles of %u x %u texels with %u levels, %.1f MB in %.2f s\n", tiles.size(), size, size, levels,
+         offset / (1024.0f * 1024.0f), seconds);
+  return 0;
+}